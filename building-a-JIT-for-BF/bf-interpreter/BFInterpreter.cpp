@@ -1,111 +1,159 @@
-#include <cassert>
+#include "BFInterpreter.h"
+#include <csignal>
+#include <cstring>
 #include <fstream>
 #include <iostream>
-#include <string>
-#include <unordered_map>
-#include <vector>
 
-constexpr int MEMORY_SIZE = 30000;
+/// Exit status of a run that was stopped and saved to its checkpoint file
+/// (EX_TEMPFAIL: resume it later with -restore).
+static const int EXIT_CHECKPOINTED = 75;
 
-class BFInterpreter
+/// Set by SIGINT and SIGTERM when the run is to be checkpointed.
+static std::atomic<bool> stop_requested(false);
+
+static void request_stop(int)
 {
-public:
-    BFInterpreter() : pc_(0), data_ptr_(0), memory_(MEMORY_SIZE, 0) {}
-    BFInterpreter(const BFInterpreter&) = delete;
-    BFInterpreter(BFInterpreter&&) = delete;
-    void interp(std::istream& stream);
+    stop_requested.store(true, std::memory_order_relaxed);
+}
 
-private:
-    std::string instructions_;
-    std::unordered_map<size_t, size_t> jump_table_;
-    size_t pc_;
-    size_t data_ptr_;
-    std::vector<uint8_t> memory_;
+struct RunOptions
+{
+    const char* name;
+    const char* profile_path;     // Write a profile here, if set
+    const char* checkpoint_path;  // Save the state here when stopped, if set
+    const char* restore_path;     // Resume from this snapshot, if set
 };
 
-void BFInterpreter::interp(std::istream& stream)
+/// Run the program in `file` on an interpreter for this configuration. With a
+/// profile path, write the loops executed the most to stderr and a flame graph of
+/// the whole run to the file. Returns the exit status.
+template <typename Cell, BFEofMode Eof>
+static int run(std::istream& file, const RunOptions& options)
 {
-    pc_ = 0;
-    data_ptr_ = 0;
-    std::vector<size_t> stack;
-    for (std::string line; std::getline(stream, line);)
+    BasicBFInterpreter<Cell, Eof> interpreter;
+    if (!options.profile_path && !options.checkpoint_path && !options.restore_path)
+        return interpreter.interp(file, options.name) ? 0 : 1;
+
+    BFProgram program;
+    BFParseError error;
+    if (!parse_from_stream(file, program, error))
+    {
+        std::cerr << error.describe(options.name) << "\n";
+        return 1;
+    }
+    program.ops = recognize_loop_idioms(program.ops, 8 * sizeof(Cell));
+    if (options.profile_path)
+        interpreter.enableProfiling();
+    if (options.checkpoint_path)
     {
-        for (auto c : line)
+        interpreter.setStopRequest(&stop_requested);
+        std::signal(SIGINT, request_stop);
+        std::signal(SIGTERM, request_stop);
+    }
+    interpreter.load(program);
+    if (options.restore_path)
+    {
+        BFSnapshot snapshot;
+        std::string message;
+        if (!read_snapshot(options.restore_path, snapshot, message) ||
+            !interpreter.restore(snapshot, message))
         {
-            if (c == '>' || c == '<' || c == '+' || c == '-' || c == '.' || c == ',' ||
-                c == '[' || c == ']')
-            {
-                instructions_.push_back(c);
-            }
-
-            if (c == '[')
-            {
-                stack.push_back(instructions_.size() - 1);
-            }
-            if (c == ']')
-            {
-                size_t back = stack.back();
-                stack.pop_back();
-                jump_table_.emplace(std::make_pair(back, instructions_.size() - 1));
-                jump_table_.emplace(std::make_pair(instructions_.size() - 1, back));
-            }
+            std::cerr << "bf-interpreter: cannot restore: " << message << "\n";
+            return 1;
         }
     }
-    assert(stack.empty());
 
-    while (pc_ < instructions_.size())
+    if (!interpreter.run())
     {
-        char instruction = instructions_[pc_];
-        switch (instruction)
+        std::string message;
+        if (!write_snapshot(options.checkpoint_path, interpreter.snapshot(), message))
         {
-        case '>':
-            data_ptr_++;
-            break;
-        case '<':
-            data_ptr_--;
-            break;
-        case '+':
-            memory_[data_ptr_]++;
-            break;
-        case '-':
-            memory_[data_ptr_]--;
-            break;
-        case '.':
-            std::cout.put(memory_[data_ptr_]);
-            break;
-        case ',':
-            memory_[data_ptr_] = std::cin.get();
-            break;
-        case '[':
-            if (memory_[data_ptr_] == 0)
-            {
-                pc_ = jump_table_[pc_];
-            }
-            break;
-        case ']':
-            if (memory_[data_ptr_] != 0)
-            {
-                pc_ = jump_table_[pc_] - 1;
-            }
-            break;
-        default:
-            assert(0 && "unreachable");
+            std::cerr << "bf-interpreter: cannot checkpoint: " << message << "\n";
+            return 1;
         }
-        pc_++;
+        return EXIT_CHECKPOINTED;
     }
+    if (options.profile_path)
+    {
+        std::cout.flush();
+        write_hot_loops(program, interpreter.profileCounts(), std::cerr);
+        std::ofstream profile(options.profile_path);
+        write_flame_graph(program, interpreter.profileCounts(), profile);
+    }
+    return 0;
+}
+
+template <typename Cell>
+static int run(std::istream& file, const RunOptions& options, BFEofMode eof)
+{
+    switch (eof)
+    {
+    case BFEofMode::Zero:
+        return run<Cell, BFEofMode::Zero>(file, options);
+    case BFEofMode::MinusOne:
+        return run<Cell, BFEofMode::MinusOne>(file, options);
+    case BFEofMode::Unchanged:
+        break;
+    }
+    return run<Cell, BFEofMode::Unchanged>(file, options);
 }
 
 int main(int argc, const char** argv)
 {
-    if (argc == 2)
+    // bf-interpreter [-profile=<file>] [-cell-bits=8|16|32]
+    //                [-eof=zero|minus-one|unchanged]
+    //                [-checkpoint=<file>] [-restore=<file>] program.bf
+    RunOptions options = { nullptr, nullptr, nullptr, nullptr };
+    unsigned cell_bits = 8;
+    BFEofMode eof = BFEofMode::MinusOne;
+    bool valid = true;
+    for (; argc > 2 && argv[1][0] == '-'; --argc, ++argv)
+    {
+        const char* arg = argv[1];
+        if (std::strncmp(arg, "-profile=", 9) == 0)
+            options.profile_path = arg + 9;
+        else if (std::strncmp(arg, "-checkpoint=", 12) == 0)
+            options.checkpoint_path = arg + 12;
+        else if (std::strncmp(arg, "-restore=", 9) == 0)
+            options.restore_path = arg + 9;
+        else if (std::strcmp(arg, "-cell-bits=8") == 0)
+            cell_bits = 8;
+        else if (std::strcmp(arg, "-cell-bits=16") == 0)
+            cell_bits = 16;
+        else if (std::strcmp(arg, "-cell-bits=32") == 0)
+            cell_bits = 32;
+        else if (std::strcmp(arg, "-eof=zero") == 0)
+            eof = BFEofMode::Zero;
+        else if (std::strcmp(arg, "-eof=minus-one") == 0)
+            eof = BFEofMode::MinusOne;
+        else if (std::strcmp(arg, "-eof=unchanged") == 0)
+            eof = BFEofMode::Unchanged;
+        else
+            valid = false;
+    }
+
+    if (argc == 2 && valid)
     {
         std::ifstream file(argv[1]);
-        BFInterpreter{}.interp(file);
+        if (!file)
+        {
+            std::cerr << "bf-interpreter: cannot open '" << argv[1] << "'\n";
+            return 1;
+        }
+        options.name = argv[1];
+        if (cell_bits == 8)
+            return run<uint8_t>(file, options, eof);
+        else if (cell_bits == 16)
+            return run<uint16_t>(file, options, eof);
+        else
+            return run<uint32_t>(file, options, eof);
     }
     else
     {
-        std::cout << "usage: bf-interpteter helloworld.bf\n";
+        std::cout << "usage: bf-interpteter [-profile=<file>] [-cell-bits=8|16|32] "
+                     "[-eof=zero|minus-one|unchanged] [-checkpoint=<file>] "
+                     "[-restore=<file>] helloworld.bf\n";
     }
 
     return 0;
-}
\ No newline at end of file
+}
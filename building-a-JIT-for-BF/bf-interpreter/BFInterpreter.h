@@ -0,0 +1,531 @@
+#ifndef BRAINFUCK_INTERPRETER_H
+#define BRAINFUCK_INTERPRETER_H
+
+#include "../bf-jit/BFKernels.h"
+#include "../bf-jit/BFProfile.h"
+#include "../bf-jit/BFProgram.h"
+#include "../bf-jit/BFSnapshot.h"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Use direct-threaded dispatch through the "labels as values" extension where the
+// compiler supports it, and fall back to a switch on the opcode elsewhere.
+#if defined(__GNUC__)
+#define BF_THREADED_DISPATCH 1
+#else
+#define BF_THREADED_DISPATCH 0
+#endif
+
+/// Native code for a whole loop, as produced by emit_loop_function: it takes the
+/// current data pointer and the end of the memory and returns the data pointer
+/// after the loop.
+using BFNativeLoop = uint8_t* (*)(uint8_t* dataptr, uint8_t* memory_end);
+
+/// Shortest run of adds to adjacent cells, or of adjacent cells cleared one after
+/// the other, that the interpreter hands to a block kernel (see BFKernels.h) rather
+/// than dispatching op by op.
+constexpr size_t MIN_KERNEL_RUN_CELLS = 16;
+
+/// Receives the loops the interpreter finds hot. An implementation typically
+/// compiles the loop in the background and hands the result back through
+/// BasicBFInterpreter::installLoop.
+class BFLoopCompiler
+{
+public:
+    virtual ~BFLoopCompiler() {}
+    /// Called once for the loop starting at program.ops[begin].
+    virtual void compileLoop(size_t begin) = 0;
+};
+
+/// An interpreter for programs on cells of type `Cell` (uint8_t, uint16_t or
+/// uint32_t) that store `Eof` on reads past the end of the input. Both are template
+/// parameters, so every configuration gets handlers of its own and none of them
+/// tests the configuration at run time.
+template <typename Cell, BFEofMode Eof>
+class BasicBFInterpreter
+{
+public:
+    /// Native code for a whole loop on this interpreter's memory; the same as
+    /// BFNativeLoop for 8-bit cells.
+    using NativeLoop = Cell* (*)(Cell* dataptr, Cell* memory_end);
+
+    BasicBFInterpreter()
+        : pc_(0), data_ptr_(0), memory_(MEMORY_SIZE, 0), input_offset_(0),
+          program_hash_(0), profiling_(false), stop_request_(nullptr),
+          loop_compiler_(nullptr), hot_loop_threshold_(0)
+    {
+    }
+    BasicBFInterpreter(const BasicBFInterpreter&) = delete;
+    BasicBFInterpreter(BasicBFInterpreter&&) = delete;
+    /// Parse, load and run the program in `stream`. A malformed program is
+    /// reported on stderr under `name`, and false returned.
+    bool interp(std::istream& stream, const std::string& name = "<stdin>");
+
+    /// Count the back-edges of every loop and report a loop to `compiler` once it
+    /// has iterated `threshold` times. Must be called before load().
+    void setLoopCompiler(BFLoopCompiler* compiler, uint32_t threshold)
+    {
+        loop_compiler_ = compiler;
+        hot_loop_threshold_ = threshold;
+    }
+
+    /// Count the ops executed, see BFProfile.h. Must be called before load().
+    void enableProfiling()
+    {
+        profiling_ = true;
+    }
+
+    /// The counts of a profiled run, indexed like the ops of the loaded program.
+    const BFProfileCounts& profileCounts() const
+    {
+        return profile_counts_;
+    }
+
+    /// Make run() return at the next loop back-edge once `*stop` is set, e.g. by a
+    /// signal handler, leaving a state that snapshot() can save. Loops running as
+    /// native code finish first. Must be called before load().
+    void setStopRequest(const std::atomic<bool>* stop)
+    {
+        stop_request_ = stop;
+    }
+
+    /// Compile the program to bytecode and reset the execution state.
+    void load(const BFProgram& program);
+
+    /// Execute the loaded program until it ends, and return true, or until a stop
+    /// is requested, and return false. Calling run() again resumes the program.
+    bool run();
+
+    /// The current execution state of the loaded program.
+    BFSnapshot snapshot() const;
+
+    /// Continue the loaded program from `snapshot` at the next run(). The input the
+    /// snapshotted run consumed is skipped on std::cin, so the program has to be
+    /// resumed on the same input. Returns false, with the reason in `error`, if the
+    /// snapshot is of another program or configuration.
+    bool restore(const BFSnapshot& snapshot, std::string& error);
+
+    /// Make the interpreter continue in `native` the next time the loop starting at
+    /// program.ops[begin] takes its back-edge. May be called from any thread.
+    void installLoop(size_t begin, NativeLoop native)
+    {
+        native_loops_[begin].store(native, std::memory_order_release);
+    }
+
+private:
+    /// Bytecode opcodes. The order must match the label table in run().
+    enum Opcode : uint8_t
+    {
+        OP_ADD,
+        OP_MOVE,
+        OP_OUTPUT,
+        OP_INPUT,
+        OP_LOOP_BEGIN,
+        OP_LOOP_END,
+        OP_CLEAR,
+        OP_MUL_ADD,
+        OP_SCAN,
+        OP_END,
+        OP_HOT_LOOP_END,  // OP_LOOP_END that also counts back-edges for tiering
+        OP_SAFEPOINT_LOOP_END,  // OP_LOOP_END that also checks for a stop request
+        OP_ADD_RUN,    // Adds to runs_[count], then continues at target
+        OP_CLEAR_RUN,  // Clears runs_[count] and moves, then continues at target
+    };
+
+    /// A single bytecode instruction. Jump targets are stored inline as the index
+    /// of the instruction to continue at, so taking a branch needs no lookup.
+    struct Bytecode
+    {
+        const void* handler;  // Label of the opcode's handler, set up by run()
+        Opcode opcode;
+        int32_t count;
+        int32_t offset;
+        uint32_t target;
+    };
+
+    /// Adjacent cells that a run of ops adds to or clears, starting at `offset`
+    /// from the data pointer; `move` is the net data pointer movement of the ops.
+    struct CellRun
+    {
+        int32_t offset;
+        uint32_t length;
+        int32_t move;
+        uint32_t deltas;  // OP_ADD_RUN: index of the first delta in run_deltas_
+    };
+
+    void compile(const BFProgram& program);
+    void fuse_runs(const std::vector<BFOp>& ops);
+
+    std::vector<Bytecode> code_;
+    std::vector<CellRun> runs_;
+    std::vector<Cell> run_deltas_;
+    size_t pc_;
+    size_t data_ptr_;
+    std::vector<Cell> memory_;
+    /// Bytes read from std::cin so far.
+    uint64_t input_offset_;
+    /// fingerprint_program of the loaded program.
+    uint64_t program_hash_;
+
+    bool profiling_;
+    /// Ops executed, indexed by bytecode index; the extra entry counts OP_END.
+    BFProfileCounts profile_counts_;
+
+    const std::atomic<bool>* stop_request_;
+
+    BFLoopCompiler* loop_compiler_;
+    uint32_t hot_loop_threshold_;
+    /// Back-edges taken so far, indexed by the bytecode index of the loop end.
+    std::vector<uint32_t> backedge_counts_;
+    /// Installed native code, indexed by the bytecode index of the loop begin.
+    std::unique_ptr<std::atomic<NativeLoop>[]> native_loops_;
+};
+
+/// The classic configuration: 8-bit cells, and -1 (255) on EOF like getchar().
+using BFInterpreter = BasicBFInterpreter<uint8_t, BFEofMode::MinusOne>;
+
+template <typename Cell, BFEofMode Eof>
+inline void BasicBFInterpreter<Cell, Eof>::compile(const BFProgram& program)
+{
+    static_assert(static_cast<int>(BFOpKind::Scan) == OP_SCAN,
+                  "opcodes must mirror BFOpKind");
+    code_.clear();
+    code_.reserve(program.ops.size() + 1);
+    for (const BFOp& op : program.ops)
+    {
+        Bytecode bc = { nullptr, static_cast<Opcode>(op.kind), op.count, op.offset, 0 };
+        // Both brackets continue right after their matching bracket when taken.
+        if (op.kind == BFOpKind::LoopBegin || op.kind == BFOpKind::LoopEnd)
+            bc.target = static_cast<uint32_t>(op.match + 1);
+        if (op.kind == BFOpKind::LoopEnd && loop_compiler_)
+            bc.opcode = OP_HOT_LOOP_END;
+        else if (op.kind == BFOpKind::LoopEnd && stop_request_)
+            bc.opcode = OP_SAFEPOINT_LOOP_END;
+        code_.push_back(bc);
+    }
+    code_.push_back(Bytecode{ nullptr, OP_END, 0, 0, 0 });
+    // A profile counts every op, so runs are only fused when not profiling.
+    runs_.clear();
+    run_deltas_.clear();
+    if (!profiling_)
+        fuse_runs(program.ops);
+
+    profile_counts_.assign(profiling_ ? code_.size() : 0, 0);
+    backedge_counts_.assign(code_.size(), 0);
+    native_loops_.reset(new std::atomic<NativeLoop>[code_.size()]);
+    for (size_t i = 0; i < code_.size(); ++i)
+        native_loops_[i].store(nullptr, std::memory_order_relaxed);
+}
+
+/// Replace the first op of every long run of adds to adjacent cells, as in
+/// ">+>++>+++...", and of cells cleared one after the other, as by "[-]>[-]>[-]...",
+/// with an op that updates the whole run through a block kernel and jumps past the
+/// rest. The skipped bytecodes stay in place, so bytecode indices keep matching op
+/// indices. Runs contain no brackets, so no branch targets the middle of one.
+template <typename Cell, BFEofMode Eof>
+inline void BasicBFInterpreter<Cell, Eof>::fuse_runs(const std::vector<BFOp>& ops)
+{
+    auto fuse = [&](size_t begin, size_t end, Opcode opcode, const CellRun& run) {
+        code_[begin].opcode = opcode;
+        code_[begin].count = static_cast<int32_t>(runs_.size());
+        code_[begin].target = static_cast<uint32_t>(end);
+        runs_.push_back(run);
+    };
+
+    for (size_t i = 0; i < ops.size(); ++i)
+    {
+        size_t end = i;
+        while (end < ops.size() && ops[end].kind == BFOpKind::Add &&
+               ops[end].offset == ops[i].offset + static_cast<int32_t>(end - i))
+            ++end;
+        if (end - i >= MIN_KERNEL_RUN_CELLS)
+        {
+            CellRun run = { ops[i].offset, static_cast<uint32_t>(end - i), 0,
+                            static_cast<uint32_t>(run_deltas_.size()) };
+            for (size_t pc = i; pc < end; ++pc)
+                run_deltas_.push_back(static_cast<Cell>(ops[pc].count));
+            fuse(i, end, OP_ADD_RUN, run);
+            i = end - 1;
+            continue;
+        }
+
+        // Clears interleaved with moves, each clearing the neighbour of the cell
+        // cleared before, always in the same direction.
+        int32_t base = 0, first = 0, last = 0, direction = 0, move = 0;
+        uint32_t cleared = 0;
+        for (size_t pc = i; pc < ops.size(); ++pc)
+        {
+            if (ops[pc].kind == BFOpKind::Move)
+            {
+                base += ops[pc].count;
+                continue;
+            }
+            if (ops[pc].kind != BFOpKind::Clear)
+                break;
+            int32_t cell = base + ops[pc].offset;
+            if (cleared > 0)
+            {
+                int32_t step = cell - last;
+                if ((step != 1 && step != -1) || (cleared > 1 && step != direction))
+                    break;
+                direction = step;
+            }
+            else
+            {
+                first = cell;
+            }
+            last = cell;
+            ++cleared;
+            end = pc + 1;
+            move = base;
+        }
+        if (cleared >= MIN_KERNEL_RUN_CELLS)
+        {
+            fuse(i, end, OP_CLEAR_RUN, CellRun{ std::min(first, last), cleared, move, 0 });
+            i = end - 1;
+        }
+    }
+}
+
+template <typename Cell, BFEofMode Eof>
+inline void BasicBFInterpreter<Cell, Eof>::load(const BFProgram& program)
+{
+    pc_ = 0;
+    data_ptr_ = 0;
+    input_offset_ = 0;
+    program_hash_ = fingerprint_program(program.ops);
+    std::fill(memory_.begin(), memory_.end(), 0);
+    compile(program);
+}
+
+template <typename Cell, BFEofMode Eof>
+inline bool BasicBFInterpreter<Cell, Eof>::run()
+{
+    Cell* memory = memory_.data();
+    Cell* dataptr = memory + data_ptr_;
+    Bytecode* code = code_.data();
+    Bytecode* ip = code + pc_;
+    uint64_t* profile_counts = profile_counts_.data();
+
+#if BF_THREADED_DISPATCH
+    static const void* const labels[] = {
+        &&L_ADD,      &&L_MOVE,  &&L_OUTPUT,  &&L_INPUT, &&L_LOOP_BEGIN,
+        &&L_LOOP_END, &&L_CLEAR, &&L_MUL_ADD, &&L_SCAN,  &&L_END,
+        &&L_HOT_LOOP_END, &&L_SAFEPOINT_LOOP_END, &&L_ADD_RUN, &&L_CLEAR_RUN,
+    };
+    // A profiled run goes through L_PROFILE before every handler.
+    for (Bytecode& bc : code_)
+        bc.handler = profiling_ ? &&L_PROFILE : labels[bc.opcode];
+#define DISPATCH() goto *ip->handler
+#else
+#define DISPATCH() goto dispatch
+dispatch:
+    if (profiling_)
+        ++profile_counts[ip - code];
+    switch (ip->opcode)
+    {
+    case OP_ADD: goto L_ADD;
+    case OP_MOVE: goto L_MOVE;
+    case OP_OUTPUT: goto L_OUTPUT;
+    case OP_INPUT: goto L_INPUT;
+    case OP_LOOP_BEGIN: goto L_LOOP_BEGIN;
+    case OP_LOOP_END: goto L_LOOP_END;
+    case OP_CLEAR: goto L_CLEAR;
+    case OP_MUL_ADD: goto L_MUL_ADD;
+    case OP_SCAN: goto L_SCAN;
+    case OP_END: goto L_END;
+    case OP_HOT_LOOP_END: goto L_HOT_LOOP_END;
+    case OP_SAFEPOINT_LOOP_END: goto L_SAFEPOINT_LOOP_END;
+    case OP_ADD_RUN: goto L_ADD_RUN;
+    case OP_CLEAR_RUN: goto L_CLEAR_RUN;
+    }
+#endif
+#define NEXT()      \
+    do              \
+    {               \
+        ++ip;       \
+        DISPATCH(); \
+    } while (0)
+
+    DISPATCH();
+
+#if BF_THREADED_DISPATCH
+L_PROFILE:
+    ++profile_counts[ip - code];
+    goto *labels[ip->opcode];
+#endif
+L_ADD:
+    dataptr[ip->offset] += ip->count;
+    NEXT();
+L_MOVE:
+    dataptr += ip->count;
+    NEXT();
+L_OUTPUT:
+    std::cout.put(static_cast<char>(dataptr[ip->offset]));
+    NEXT();
+L_INPUT:
+{
+    // `Eof` is a constant, so only one of the EOF branches is compiled in.
+    int input = std::cin.get();
+    if (input != EOF)
+    {
+        dataptr[ip->offset] = static_cast<Cell>(input);
+        ++input_offset_;
+    }
+    else if (Eof == BFEofMode::Zero)
+        dataptr[ip->offset] = 0;
+    else if (Eof == BFEofMode::MinusOne)
+        dataptr[ip->offset] = static_cast<Cell>(-1);
+    NEXT();
+}
+L_LOOP_BEGIN:
+    if (*dataptr == 0)
+    {
+        ip = code + ip->target;
+        DISPATCH();
+    }
+    NEXT();
+L_LOOP_END:
+    if (*dataptr != 0)
+    {
+        ip = code + ip->target;
+        DISPATCH();
+    }
+    NEXT();
+L_CLEAR:
+    dataptr[ip->offset] = 0;
+    NEXT();
+L_MUL_ADD:
+    // The loop this came from never ran, and never touched the target cell, if the
+    // current cell is 0; the target may then lie outside the memory. Multiply in
+    // uint32_t: promoting 16-bit cells to int could overflow.
+    if (*dataptr != 0)
+        dataptr[ip->offset] += static_cast<Cell>(static_cast<uint32_t>(*dataptr) *
+                                                 static_cast<uint32_t>(ip->count));
+    NEXT();
+L_SCAN:
+    dataptr = scan_cells(dataptr, ip->count);
+    NEXT();
+L_ADD_RUN:
+{
+    const CellRun& run = runs_[ip->count];
+    add_cells(dataptr + run.offset, run_deltas_.data() + run.deltas, run.length);
+    ip = code + ip->target;
+    DISPATCH();
+}
+L_CLEAR_RUN:
+{
+    const CellRun& run = runs_[ip->count];
+    clear_cells(dataptr + run.offset, run.length);
+    dataptr += run.move;
+    ip = code + ip->target;
+    DISPATCH();
+}
+L_HOT_LOOP_END:
+    if (*dataptr != 0)
+    {
+        size_t begin = ip->target - 1;
+        // Once native code for this loop is installed, it takes over right at the
+        // next iteration and the interpreter resumes after the loop.
+        NativeLoop native = native_loops_[begin].load(std::memory_order_acquire);
+        if (native)
+        {
+            dataptr = native(dataptr, memory + memory_.size());
+            NEXT();
+        }
+        if (++backedge_counts_[ip - code] == hot_loop_threshold_)
+            loop_compiler_->compileLoop(begin);
+        if (stop_request_ && stop_request_->load(std::memory_order_relaxed))
+            goto L_STOP;
+        ip = code + ip->target;
+        DISPATCH();
+    }
+    NEXT();
+L_SAFEPOINT_LOOP_END:
+    if (*dataptr != 0)
+    {
+        if (stop_request_->load(std::memory_order_relaxed))
+            goto L_STOP;
+        ip = code + ip->target;
+        DISPATCH();
+    }
+    NEXT();
+L_STOP:
+    // Stop before the back-edge: resuming at this loop end tests the cell again
+    // and continues the loop.
+    pc_ = ip - code;
+    data_ptr_ = dataptr - memory;
+    std::cout.flush();
+    return false;
+L_END:
+#undef NEXT
+#undef DISPATCH
+    pc_ = ip - code;
+    data_ptr_ = dataptr - memory;
+    return true;
+}
+
+template <typename Cell, BFEofMode Eof>
+inline BFSnapshot BasicBFInterpreter<Cell, Eof>::snapshot() const
+{
+    BFSnapshot snapshot;
+    snapshot.program_hash = program_hash_;
+    snapshot.eof = Eof;
+    snapshot.pc = pc_;
+    snapshot.data_ptr = data_ptr_;
+    snapshot.input_offset = input_offset_;
+    snapshot_memory(memory_, snapshot);
+    return snapshot;
+}
+
+template <typename Cell, BFEofMode Eof>
+inline bool BasicBFInterpreter<Cell, Eof>::restore(const BFSnapshot& snapshot,
+                                                   std::string& error)
+{
+    if (snapshot.program_hash != program_hash_)
+        error = "the snapshot is of a different program";
+    else if (snapshot.cell_bits != 8 * sizeof(Cell) || snapshot.eof != Eof)
+        error = "the snapshot was taken with a different -cell-bits or -eof";
+    else if (snapshot.tape_size != memory_.size() || snapshot.pc >= code_.size() ||
+             snapshot.data_ptr >= memory_.size())
+        error = "the snapshot does not fit this interpreter's memory";
+    else
+        error.clear();
+    if (!error.empty())
+        return false;
+
+    pc_ = static_cast<size_t>(snapshot.pc);
+    data_ptr_ = static_cast<size_t>(snapshot.data_ptr);
+    input_offset_ = snapshot.input_offset;
+    restore_memory(snapshot, memory_);
+    for (uint64_t skipped = 0; skipped < input_offset_; ++skipped)
+    {
+        if (std::cin.get() == EOF)
+            break;
+    }
+    return true;
+}
+
+template <typename Cell, BFEofMode Eof>
+inline bool BasicBFInterpreter<Cell, Eof>::interp(std::istream& stream,
+                                                  const std::string& name)
+{
+    BFProgram program;
+    BFParseError error;
+    if (!parse_from_stream(stream, program, error))
+    {
+        std::cerr << error.describe(name) << "\n";
+        return false;
+    }
+    program.ops = recognize_loop_idioms(program.ops, 8 * sizeof(Cell));
+    load(program);
+    return run();
+}
+
+#endif  // BRAINFUCK_INTERPRETER_H
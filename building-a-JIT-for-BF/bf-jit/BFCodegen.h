@@ -0,0 +1,796 @@
+#ifndef BRAINFUCK_CODEGEN_H
+#define BRAINFUCK_CODEGEN_H
+
+#include "BFProgram.h"
+#include "BFRuntime.h"
+#include <cassert>
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Type.h>
+#include <llvm/Support/CodeGen.h>
+#include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/IPO/PassManagerBuilder.h>
+#include <llvm/Transforms/InstCombine/InstCombine.h>
+#include <llvm/Transforms/Scalar.h>
+#include <map>
+#include <stack>
+#include <string>
+
+const char* const JIT_FUNC_NAME = "__llvmjit";
+
+/// The cells the emitted code works on. These are emission parameters: the code
+/// for each configuration is specialized for it and never tests it at run time.
+struct BFCellConfig
+{
+    unsigned cell_bits;  // 8, 16 or 32
+    BFEofMode eof;       // What ',' stores at the end of the input
+
+    explicit BFCellConfig(unsigned cell_bits = 8, BFEofMode eof = BFEofMode::MinusOne)
+        : cell_bits(cell_bits), eof(eof)
+    {
+    }
+
+    unsigned cell_bytes() const
+    {
+        return cell_bits / 8;
+    }
+};
+
+/// Shortest run of adjacent cells cleared by a block that is zeroed with a memset
+/// rather than with one store per cell.
+constexpr size_t MIN_MEMSET_CLEAR_CELLS = 16;
+
+/// The runtime of a module as seen by the emitted code. The output buffer and its
+/// size live in the module itself, so the hot output path needs no call at all;
+/// the functions are provided by the host, see BFRuntime.h, or defined in the
+/// module itself by emit_standalone_runtime.
+struct BFRuntimeDecls
+{
+    llvm::GlobalVariable* output_buffer;  // [OUTPUT_BUFFER_SIZE x i8]
+    llvm::GlobalVariable* output_size;    // i64
+    llvm::Function* flush_output_fn;      // void (i8* buffer, i64 size)
+    llvm::Function* read_input_fn;        // i32 (i8* output_buffer, i64* output_size)
+    llvm::Function* scan_fn;              // i8* (i8* dataptr, i32 stride)
+    /// [N x i64] counts of executed ops, see BFProfile.h; only set when profiling.
+    llvm::GlobalVariable* profile_counts;
+};
+
+/// Define the output buffer and declare the runtime functions in `module`.
+inline BFRuntimeDecls declare_runtime(llvm::Module* module)
+{
+    llvm::LLVMContext& context = module->getContext();
+    llvm::Type* void_type = llvm::Type::getVoidTy(context);
+    llvm::Type* int32_type = llvm::Type::getInt32Ty(context);
+    llvm::Type* int64_type = llvm::Type::getInt64Ty(context);
+    llvm::Type* int8_ptr_type = llvm::Type::getInt8PtrTy(context);
+    llvm::ArrayType* buffer_type =
+        llvm::ArrayType::get(llvm::Type::getInt8Ty(context), OUTPUT_BUFFER_SIZE);
+
+    BFRuntimeDecls runtime;
+    runtime.output_buffer = new llvm::GlobalVariable(
+        *module, buffer_type, false, llvm::GlobalValue::InternalLinkage,
+        llvm::ConstantAggregateZero::get(buffer_type), "output_buffer");
+    runtime.output_size = new llvm::GlobalVariable(
+        *module, int64_type, false, llvm::GlobalValue::InternalLinkage,
+        llvm::ConstantInt::get(int64_type, 0), "output_size");
+    runtime.flush_output_fn = llvm::Function::Create(
+        llvm::FunctionType::get(void_type, { int8_ptr_type, int64_type }, false),
+        llvm::Function::ExternalLinkage, RUNTIME_FLUSH_OUTPUT_NAME, module);
+    llvm::Type* int64_ptr_type = llvm::PointerType::getUnqual(int64_type);
+    runtime.read_input_fn = llvm::Function::Create(
+        llvm::FunctionType::get(int32_type, { int8_ptr_type, int64_ptr_type }, false),
+        llvm::Function::ExternalLinkage, RUNTIME_READ_INPUT_NAME, module);
+    runtime.scan_fn = llvm::Function::Create(
+        llvm::FunctionType::get(int8_ptr_type, { int8_ptr_type, int32_type }, false),
+        llvm::Function::ExternalLinkage, RUNTIME_SCAN_NAME, module);
+    runtime.profile_counts = nullptr;
+    return runtime;
+}
+
+/// Make the code emitted for `runtime` count the ops it executes into the host's
+/// profile counts, one per op of a program with `num_ops` ops.
+inline void declare_profile_counts(llvm::Module* module, BFRuntimeDecls& runtime,
+                                   size_t num_ops)
+{
+    llvm::ArrayType* counts_type =
+        llvm::ArrayType::get(llvm::Type::getInt64Ty(module->getContext()), num_ops);
+    runtime.profile_counts = new llvm::GlobalVariable(
+        *module, counts_type, false, llvm::GlobalValue::ExternalLinkage, nullptr,
+        RUNTIME_PROFILE_COUNTS_NAME);
+}
+
+/// Emit a call that writes out the pending output and empties the buffer.
+inline void emit_flush_output(llvm::IRBuilder<>& builder, const BFRuntimeDecls& runtime)
+{
+    llvm::Value* buffer = builder.CreateConstInBoundsGEP2_32(
+        runtime.output_buffer->getValueType(), runtime.output_buffer, 0, 0, "buffer");
+    llvm::Value* size = builder.CreateLoad(runtime.output_size, "output_size");
+    builder.CreateCall(runtime.flush_output_fn, { buffer, size });
+    builder.CreateStore(builder.getInt64(0), runtime.output_size);
+}
+
+/// A loop whose ']' has not been emitted yet. The data pointer is an SSA value, so
+/// both the loop body and the loop exit start with a PHI that merges the data
+/// pointer coming from the '[' test with the one coming from the ']' test.
+struct OpenLoop
+{
+    llvm::BasicBlock* body_block;
+    llvm::BasicBlock* exit_block;
+    llvm::PHINode* body_dataptr;
+    llvm::PHINode* exit_dataptr;
+};
+
+/// Emit IR for program.ops[begin, end) at the insert point of `builder`, starting
+/// with `dataptr` pointing to the current cell, and return the data pointer after
+/// the last op. Both it and `memory_end`, which points one past the last cell, are
+/// pointers to cells as described by `config`. The range must contain balanced
+/// brackets.
+inline llvm::Value* emit_ops(const BFProgram& program, size_t begin, size_t end,
+                             llvm::IRBuilder<>& builder, llvm::Value* dataptr,
+                             llvm::Value* memory_end, const BFRuntimeDecls& runtime,
+                             const BFCellConfig& config = BFCellConfig())
+{
+    llvm::Function* jit_fn = builder.GetInsertBlock()->getParent();
+    llvm::Module* module = jit_fn->getParent();
+    llvm::LLVMContext& context = module->getContext();
+
+    llvm::Type* int32_type = llvm::Type::getInt32Ty(context);
+    llvm::Type* int8_type = llvm::Type::getInt8Ty(context);
+    llvm::Type* int8_ptr_type = llvm::Type::getInt8PtrTy(context);
+    llvm::IntegerType* cell_type = llvm::Type::getIntNTy(context, config.cell_bits);
+    llvm::Type* cell_ptr_type = cell_type->getPointerTo();
+    llvm::Constant* zero = llvm::ConstantInt::get(cell_type, 0);
+
+    // A constant cell value; `value` wraps around like the cell does.
+    auto get_cell = [&](int32_t value) -> llvm::Constant* {
+        return llvm::ConstantInt::get(cell_type, static_cast<int64_t>(value), true);
+    };
+
+    // Compute the address of the cell at `offset` from the current data pointer.
+    auto emit_element_addr = [&](int32_t offset) -> llvm::Value* {
+        if (offset == 0)
+            return dataptr;
+        return builder.CreateInBoundsGEP(dataptr, builder.getInt32(offset),
+                                         "element_addr");
+    };
+
+    // Lower "[>]" to a memchr call over the rest of the memory, which libc
+    // implements with vector instructions. If no cell is zero the data pointer
+    // moves to `memory_end`, so the next access faults in the right guard like
+    // the other scans do.
+    auto emit_memchr_scan = [&]() {
+        llvm::Type* int64_type = llvm::Type::getInt64Ty(context);
+        llvm::Constant* memchr_fn = module->getOrInsertFunction(
+            "memchr", int8_ptr_type, int8_ptr_type, int32_type, int64_type);
+        llvm::Value* remaining = builder.CreatePtrDiff(memory_end, dataptr, "remaining");
+        llvm::Value* found = builder.CreateCall(
+            memchr_fn, { dataptr, builder.getInt32(0), remaining }, "found");
+        dataptr = builder.CreateSelect(builder.CreateIsNull(found), memory_end, found,
+                                       "scanned_dataptr");
+    };
+
+    // Lower scans such as "[<]" or "[>>]" to a call to the runtime's vector scan
+    // kernel, see BFKernels.h.
+    auto emit_kernel_scan = [&](int32_t stride) {
+        dataptr = builder.CreateCall(
+            runtime.scan_fn, { dataptr, builder.getInt32(stride) }, "scanned_dataptr");
+    };
+
+    // Lower scans with strides the kernels do not vectorize, such as "[>>>]", to a
+    // tight loop that only moves the data pointer.
+    auto emit_loop_scan = [&](int32_t stride) {
+        llvm::BasicBlock* entry_block = builder.GetInsertBlock();
+        llvm::BasicBlock* scan_header_block =
+            llvm::BasicBlock::Create(context, "scan_header", jit_fn);
+        llvm::BasicBlock* scan_body_block =
+            llvm::BasicBlock::Create(context, "scan_body", jit_fn);
+        llvm::BasicBlock* scan_exit_block =
+            llvm::BasicBlock::Create(context, "scan_exit", jit_fn);
+        builder.CreateBr(scan_header_block);
+
+        builder.SetInsertPoint(scan_header_block);
+        llvm::PHINode* header_dataptr = builder.CreatePHI(cell_ptr_type, 2, "dataptr");
+        header_dataptr->addIncoming(dataptr, entry_block);
+        llvm::Value* element = builder.CreateLoad(header_dataptr, "element");
+        llvm::Value* cmp = builder.CreateICmpEQ(element, zero);
+        builder.CreateCondBr(cmp, scan_exit_block, scan_body_block);
+
+        builder.SetInsertPoint(scan_body_block);
+        llvm::Value* moved_dataptr = builder.CreateInBoundsGEP(
+            header_dataptr, builder.getInt32(stride), "moved_dataptr");
+        header_dataptr->addIncoming(moved_dataptr, scan_body_block);
+        builder.CreateBr(scan_header_block);
+
+        builder.SetInsertPoint(scan_exit_block);
+        dataptr = header_dataptr;
+    };
+
+    // Emit a straight-line block with every cell it touches in an SSA value: one
+    // load per live-in cell, at its first access, and one store per written cell
+    // on exit, no matter how often the ops of the block access the cell.
+    auto emit_block = [&](const BFBlock& block) {
+        std::map<int32_t, llvm::Value*> cells;
+        auto get_element = [&](int32_t offset) -> llvm::Value* {
+            auto it = cells.find(offset);
+            if (it != cells.end())
+                return it->second;
+            return cells[offset] =
+                       builder.CreateLoad(emit_element_addr(offset), "element");
+        };
+
+        int32_t base = 0;
+        for (size_t pc = block.begin; pc < block.end; ++pc)
+        {
+            const BFOp& op = program.ops[pc];
+            int32_t offset = base + op.offset;
+            switch (op.kind)
+            {
+            case BFOpKind::Move:
+                base += op.count;
+                break;
+            case BFOpKind::Add:
+                cells[offset] = builder.CreateAdd(get_element(offset), get_cell(op.count),
+                                                  "add_element");
+                break;
+            case BFOpKind::Clear:
+                cells[offset] = zero;
+                break;
+            case BFOpKind::MulAdd:
+            {
+                // The MulAdds of a multiply loop only run if the current cell is not
+                // 0, as the loop would; its cells may lie outside the memory
+                // otherwise. Cells that are in registers already get a phi at the
+                // join, the others are loaded and stored back in the guarded block.
+                llvm::Value* element = get_element(base);
+                llvm::BasicBlock* entry_block = builder.GetInsertBlock();
+                llvm::BasicBlock* mul_block =
+                    llvm::BasicBlock::Create(context, "mul_add", jit_fn);
+                llvm::BasicBlock* join_block =
+                    llvm::BasicBlock::Create(context, "mul_add_cont", jit_fn);
+                builder.CreateCondBr(builder.CreateICmpNE(element, zero), mul_block,
+                                     join_block);
+                builder.SetInsertPoint(mul_block);
+                std::vector<std::pair<int32_t, llvm::Value*>> updated;
+                for (; pc < block.end && program.ops[pc].kind == BFOpKind::MulAdd &&
+                       program.ops[pc].source == op.source;
+                     ++pc)
+                {
+                    int32_t target = base + program.ops[pc].offset;
+                    llvm::Value* product = builder.CreateMul(
+                        element, get_cell(program.ops[pc].count), "product");
+                    auto it = cells.find(target);
+                    if (it != cells.end())
+                    {
+                        updated.push_back(std::make_pair(
+                            target, builder.CreateAdd(it->second, product, "add_element")));
+                        continue;
+                    }
+                    llvm::Value* element_addr = emit_element_addr(target);
+                    llvm::Value* target_element = builder.CreateLoad(element_addr, "element");
+                    builder.CreateStore(
+                        builder.CreateAdd(target_element, product, "add_element"),
+                        element_addr);
+                }
+                --pc;
+                builder.CreateBr(join_block);
+                builder.SetInsertPoint(join_block);
+                for (const auto& cell : updated)
+                {
+                    llvm::PHINode* phi = builder.CreatePHI(cell_type, 2, "element");
+                    phi->addIncoming(cells[cell.first], entry_block);
+                    phi->addIncoming(cell.second, mul_block);
+                    cells[cell.first] = phi;
+                }
+                break;
+            }
+            default:
+                assert(0 && "unreachable!");
+            }
+        }
+
+        // Cells are in offset order, so runs of adjacent cleared cells, as left by
+        // "[-]>[-]>[-]...", are found in one pass and zeroed with one memset, which
+        // the backend expands to vector stores. Cells that only a guarded MulAdd
+        // wrote are stored already.
+        auto cleared = [&](const BFCellAccess& cell) {
+            auto it = cells.find(cell.offset);
+            return cell.written && it != cells.end() && it->second == zero;
+        };
+        for (size_t i = 0; i < block.cells.size();)
+        {
+            const BFCellAccess& cell = block.cells[i];
+            size_t run_end = i;
+            while (run_end < block.cells.size() && cleared(block.cells[run_end]) &&
+                   block.cells[run_end].offset ==
+                       cell.offset + static_cast<int32_t>(run_end - i))
+                ++run_end;
+            if (run_end - i >= MIN_MEMSET_CLEAR_CELLS)
+            {
+                builder.CreateMemSet(emit_element_addr(cell.offset), builder.getInt8(0),
+                                     (run_end - i) * config.cell_bytes(), 1);
+                i = run_end;
+                continue;
+            }
+            auto it = cells.find(cell.offset);
+            if (cell.written && it != cells.end())
+                builder.CreateStore(it->second, emit_element_addr(cell.offset));
+            ++i;
+        }
+        if (block.move != 0)
+            dataptr = builder.CreateInBoundsGEP(dataptr, builder.getInt32(block.move),
+                                                "moved_dataptr");
+    };
+
+    // When profiling, add `ops` to the count of program.ops[pc].
+    auto emit_profile_count = [&](size_t pc, size_t ops) {
+        if (!runtime.profile_counts)
+            return;
+        llvm::Value* count_addr = builder.CreateConstInBoundsGEP2_32(
+            runtime.profile_counts->getValueType(), runtime.profile_counts, 0,
+            static_cast<unsigned>(pc), "profile_count_addr");
+        llvm::Value* count = builder.CreateLoad(count_addr, "profile_count");
+        builder.CreateStore(builder.CreateAdd(count, builder.getInt64(ops)), count_addr);
+    };
+
+    std::stack<OpenLoop> open_loop_stack;
+
+    for (size_t pc = begin; pc < end; ++pc)
+    {
+        const BFOp& op = program.ops[pc];
+        if (is_block_op(op.kind))
+        {
+            BFBlock block = analyze_block(program.ops, pc, end);
+            emit_profile_count(pc, block.end - block.begin);
+            emit_block(block);
+            pc = block.end - 1;
+            continue;
+        }
+
+        emit_profile_count(pc, 1);
+        switch (op.kind)
+        {
+        case BFOpKind::Output:
+        {
+            // Append the cell to the output buffer and only call into the runtime
+            // once the buffer is full.
+            llvm::Value* element_addr = emit_element_addr(op.offset);
+            llvm::Value* element = builder.CreateTrunc(
+                builder.CreateLoad(element_addr, "element"), int8_type, "output_byte");
+            llvm::Value* size = builder.CreateLoad(runtime.output_size, "output_size");
+            llvm::Value* slot = builder.CreateInBoundsGEP(
+                runtime.output_buffer, { builder.getInt64(0), size }, "output_slot");
+            builder.CreateStore(element, slot);
+            llvm::Value* new_size =
+                builder.CreateAdd(size, builder.getInt64(1), "new_output_size");
+            builder.CreateStore(new_size, runtime.output_size);
+            llvm::Value* full = builder.CreateICmpEQ(
+                new_size, builder.getInt64(OUTPUT_BUFFER_SIZE), "output_full");
+            llvm::BasicBlock* flush_block =
+                llvm::BasicBlock::Create(context, "flush_output", jit_fn);
+            llvm::BasicBlock* cont_block =
+                llvm::BasicBlock::Create(context, "output_cont", jit_fn);
+            builder.CreateCondBr(full, flush_block, cont_block);
+            builder.SetInsertPoint(flush_block);
+            emit_flush_output(builder, runtime);
+            builder.CreateBr(cont_block);
+            builder.SetInsertPoint(cont_block);
+            break;
+        }
+        case BFOpKind::Input:
+        {
+            llvm::Value* buffer = builder.CreateConstInBoundsGEP2_32(
+                runtime.output_buffer->getValueType(), runtime.output_buffer, 0, 0,
+                "buffer");
+            llvm::Value* user_input = builder.CreateCall(
+                runtime.read_input_fn, { buffer, runtime.output_size }, "user_input");
+            llvm::Value* element_addr = emit_element_addr(op.offset);
+            // The runtime returns -1 at EOF, which sign-extends to a cell with all
+            // bits set. The other EOF modes select their value instead.
+            llvm::Value* element =
+                builder.CreateIntCast(user_input, cell_type, true, "user_input_cell");
+            if (config.eof != BFEofMode::MinusOne)
+            {
+                llvm::Value* at_eof =
+                    builder.CreateICmpSLT(user_input, builder.getInt32(0), "at_eof");
+                llvm::Value* eof_element =
+                    config.eof == BFEofMode::Zero
+                        ? zero
+                        : builder.CreateLoad(element_addr, "element");
+                element = builder.CreateSelect(at_eof, eof_element, element);
+            }
+            builder.CreateStore(element, element_addr);
+            break;
+        }
+        case BFOpKind::LoopBegin:
+        {
+            llvm::BasicBlock* entry_block = builder.GetInsertBlock();
+            llvm::Value* element = builder.CreateLoad(dataptr, "element");
+            llvm::Value* cmp = builder.CreateICmpEQ(element, zero);
+            OpenLoop loop;
+            loop.body_block = llvm::BasicBlock::Create(context, "loop_body", jit_fn);
+            loop.exit_block = llvm::BasicBlock::Create(context, "loop_exit", jit_fn);
+            builder.CreateCondBr(cmp, loop.exit_block, loop.body_block);
+
+            builder.SetInsertPoint(loop.exit_block);
+            loop.exit_dataptr = builder.CreatePHI(cell_ptr_type, 2, "dataptr");
+            loop.exit_dataptr->addIncoming(dataptr, entry_block);
+            // This specifies that following created instructions should be appended to
+            // the end of the specified block.
+            builder.SetInsertPoint(loop.body_block);
+            loop.body_dataptr = builder.CreatePHI(cell_ptr_type, 2, "dataptr");
+            loop.body_dataptr->addIncoming(dataptr, entry_block);
+            dataptr = loop.body_dataptr;
+            open_loop_stack.push(loop);
+            break;
+        }
+        case BFOpKind::LoopEnd:
+        {
+            OpenLoop loop = open_loop_stack.top();
+            open_loop_stack.pop();
+            llvm::BasicBlock* latch_block = builder.GetInsertBlock();
+            llvm::Value* element = builder.CreateLoad(dataptr, "element");
+            llvm::Value* cmp = builder.CreateICmpNE(element, zero);
+            builder.CreateCondBr(cmp, loop.body_block, loop.exit_block);
+            loop.body_dataptr->addIncoming(dataptr, latch_block);
+            loop.exit_dataptr->addIncoming(dataptr, latch_block);
+            // This specifies that following created instructions should be appended to
+            // the end of the specified block.
+            builder.SetInsertPoint(loop.exit_block);
+            dataptr = loop.exit_dataptr;
+            break;
+        }
+        case BFOpKind::Scan:
+        {
+            // The library and runtime scans only search bytes.
+            if (config.cell_bits == 8 && op.count == 1)
+                emit_memchr_scan();
+            else if (config.cell_bits == 8 && scan_stride_pattern(op.count) != 0)
+                emit_kernel_scan(op.count);
+            else
+                emit_loop_scan(op.count);
+            break;
+        }
+        default:
+            assert(0 && "unreachable!");
+        }
+    }
+    assert(open_loop_stack.empty() && "unbalanced loop range");
+    return dataptr;
+}
+
+/// Name of the function emit_loop_function creates for the loop starting at
+/// program.ops[begin].
+inline std::string loop_function_name(size_t begin)
+{
+    return "__bf_loop_" + std::to_string(begin);
+}
+
+/// Emit the function `void __llvmjit(i8* memory, i64 memory_size)` that runs the
+/// whole program on the given memory, starting at its first cell. With
+/// `outline_loops`, every outermost loop is left to an external function named
+/// loop_function_name(begin), which the caller must provide (see
+/// emit_loop_function). The memory is passed as bytes whatever the cells in
+/// `config`; `memory_size` is its size in bytes.
+inline llvm::Function* emit_jit_function(const BFProgram& program, llvm::Module* module,
+                                         const BFRuntimeDecls& runtime,
+                                         const BFCellConfig& config = BFCellConfig(),
+                                         bool outline_loops = false)
+{
+    llvm::LLVMContext& context = module->getContext();
+
+    llvm::Type* int64_type = llvm::Type::getInt64Ty(context);
+    llvm::Type* void_type = llvm::Type::getVoidTy(context);
+    llvm::Type* int8_ptr_type = llvm::Type::getInt8PtrTy(context);
+    llvm::Type* cell_ptr_type =
+        llvm::Type::getIntNTy(context, config.cell_bits)->getPointerTo();
+
+    llvm::FunctionType* jit_fn_type =
+        llvm::FunctionType::get(void_type, { int8_ptr_type, int64_type }, false);
+    llvm::Function* jit_fn = llvm::Function::Create(
+        jit_fn_type, llvm::Function::ExternalLinkage, JIT_FUNC_NAME, module);
+    llvm::Function::arg_iterator args = jit_fn->arg_begin();
+    llvm::Argument* memory = &*args++;
+    memory->setName("memory");
+    llvm::Argument* memory_size = &*args++;
+    memory_size->setName("memory_size");
+
+    llvm::BasicBlock* entry_bb = llvm::BasicBlock::Create(context, "entry", jit_fn);
+    llvm::IRBuilder<> builder(entry_bb);
+
+    // The memory is owned by the caller (see BFTape.h) and is already zeroed. The
+    // data pointer starts at the first cell and only lives in SSA values.
+    llvm::Value* memory_end = builder.CreateInBoundsGEP(memory, memory_size, "memory_end");
+    llvm::Value* cells = builder.CreateBitCast(memory, cell_ptr_type, "cells");
+    llvm::Value* cells_end =
+        builder.CreateBitCast(memory_end, cell_ptr_type, "cells_end");
+    if (!outline_loops)
+    {
+        emit_ops(program, 0, program.ops.size(), builder, cells, cells_end, runtime,
+                 config);
+    }
+    else
+    {
+        llvm::FunctionType* loop_fn_type = llvm::FunctionType::get(
+            int8_ptr_type, { int8_ptr_type, int8_ptr_type }, false);
+        llvm::Value* dataptr = cells;
+        size_t pc = 0;
+        for (;;)
+        {
+            size_t loop_begin = pc;
+            while (loop_begin < program.ops.size() &&
+                   program.ops[loop_begin].kind != BFOpKind::LoopBegin)
+                ++loop_begin;
+            dataptr = emit_ops(program, pc, loop_begin, builder, dataptr, cells_end,
+                               runtime, config);
+            if (loop_begin == program.ops.size())
+                break;
+
+            // The loop function writes to an output buffer of its own.
+            emit_flush_output(builder, runtime);
+            llvm::Constant* loop_fn = module->getOrInsertFunction(
+                loop_function_name(loop_begin), loop_fn_type);
+            llvm::Value* loop_dataptr = builder.CreateCall(
+                loop_fn, { builder.CreateBitCast(dataptr, int8_ptr_type), memory_end },
+                "dataptr");
+            dataptr = builder.CreateBitCast(loop_dataptr, cell_ptr_type);
+            pc = program.ops[loop_begin].match + 1;
+        }
+    }
+
+    emit_flush_output(builder, runtime);
+    builder.CreateRetVoid();
+    return jit_fn;
+}
+
+/// Emit a function `i8* (i8* dataptr, i8* memory_end)` that runs the whole loop
+/// starting at program.ops[begin], including its first bracket test, on memory
+/// owned by the caller and returns the data pointer after the loop. The pointers
+/// are passed as bytes whatever the cells in `config`.
+inline llvm::Function* emit_loop_function(const BFProgram& program, size_t begin,
+                                          llvm::Module* module,
+                                          const BFRuntimeDecls& runtime,
+                                          const BFCellConfig& config = BFCellConfig())
+{
+    assert(program.ops[begin].kind == BFOpKind::LoopBegin);
+    llvm::LLVMContext& context = module->getContext();
+
+    llvm::Type* int8_ptr_type = llvm::Type::getInt8PtrTy(context);
+    llvm::Type* cell_ptr_type =
+        llvm::Type::getIntNTy(context, config.cell_bits)->getPointerTo();
+
+    llvm::FunctionType* loop_fn_type =
+        llvm::FunctionType::get(int8_ptr_type, { int8_ptr_type, int8_ptr_type }, false);
+    llvm::Function* loop_fn =
+        llvm::Function::Create(loop_fn_type, llvm::Function::ExternalLinkage,
+                               loop_function_name(begin), module);
+    llvm::Function::arg_iterator args = loop_fn->arg_begin();
+    llvm::Argument* dataptr = &*args++;
+    dataptr->setName("dataptr");
+    llvm::Argument* memory_end = &*args++;
+    memory_end->setName("memory_end");
+
+    llvm::BasicBlock* entry_bb = llvm::BasicBlock::Create(context, "entry", loop_fn);
+    llvm::IRBuilder<> builder(entry_bb);
+    llvm::Value* exit_dataptr = emit_ops(
+        program, begin, program.ops[begin].match + 1, builder,
+        builder.CreateBitCast(dataptr, cell_ptr_type, "cells"),
+        builder.CreateBitCast(memory_end, cell_ptr_type, "cells_end"), runtime, config);
+    exit_dataptr = builder.CreateBitCast(exit_dataptr, int8_ptr_type);
+
+    // The caller may write output of its own after the loop.
+    emit_flush_output(builder, runtime);
+    builder.CreateRet(exit_dataptr);
+    return loop_fn;
+}
+
+/// Define the runtime functions declared by declare_runtime on top of libc, and a
+/// `int main()` that runs the JIT function on a zeroed memory of `memory_size`
+/// bytes, so that the module links into a standalone executable. The runtime
+/// functions get internal linkage, so that optimize_module can inline them when
+/// asked to.
+inline void emit_standalone_runtime(llvm::Module* module, const BFRuntimeDecls& runtime,
+                                    uint64_t memory_size)
+{
+    llvm::LLVMContext& context = module->getContext();
+    llvm::Type* int32_type = llvm::Type::getInt32Ty(context);
+    llvm::Type* int64_type = llvm::Type::getInt64Ty(context);
+    llvm::Type* int8_ptr_type = llvm::Type::getInt8PtrTy(context);
+
+    // FILE* is only passed around, so an i8* will do.
+    llvm::GlobalVariable* stdout_var = new llvm::GlobalVariable(
+        *module, int8_ptr_type, false, llvm::GlobalValue::ExternalLinkage, nullptr,
+        "stdout");
+    llvm::Constant* fwrite_fn = module->getOrInsertFunction(
+        "fwrite", int64_type, int8_ptr_type, int64_type, int64_type, int8_ptr_type);
+    llvm::Constant* fflush_fn =
+        module->getOrInsertFunction("fflush", int32_type, int8_ptr_type);
+    llvm::Constant* getchar_fn = module->getOrInsertFunction("getchar", int32_type);
+    llvm::Constant* calloc_fn = module->getOrInsertFunction(
+        "calloc", int8_ptr_type, int64_type, int64_type);
+
+    // void __bf_flush_output(i8* buffer, i64 size): fwrite the buffer to stdout.
+    {
+        llvm::Function* fn = runtime.flush_output_fn;
+        fn->setLinkage(llvm::GlobalValue::InternalLinkage);
+        llvm::IRBuilder<> builder(llvm::BasicBlock::Create(context, "entry", fn));
+        llvm::Function::arg_iterator args = fn->arg_begin();
+        llvm::Argument* buffer = &*args++;
+        llvm::Argument* size = &*args++;
+        llvm::Value* stream = builder.CreateLoad(stdout_var, "stdout");
+        builder.CreateCall(fwrite_fn, { buffer, builder.getInt64(1), size, stream });
+        builder.CreateRetVoid();
+    }
+
+    // i32 __bf_read_input(i8* output_buffer, i64* output_size): flush the pending
+    // output, so that prompts are seen, and getchar(), whose EOF is -1 as well.
+    {
+        llvm::Function* fn = runtime.read_input_fn;
+        fn->setLinkage(llvm::GlobalValue::InternalLinkage);
+        llvm::IRBuilder<> builder(llvm::BasicBlock::Create(context, "entry", fn));
+        llvm::Function::arg_iterator args = fn->arg_begin();
+        llvm::Argument* output_buffer = &*args++;
+        llvm::Argument* output_size = &*args++;
+        llvm::Value* size = builder.CreateLoad(output_size, "size");
+        builder.CreateCall(runtime.flush_output_fn, { output_buffer, size });
+        builder.CreateStore(builder.getInt64(0), output_size);
+        llvm::Value* stream = builder.CreateLoad(stdout_var, "stdout");
+        builder.CreateCall(fflush_fn, { stream });
+        builder.CreateRet(builder.CreateCall(getchar_fn, {}, "input"));
+    }
+
+    // i8* __bf_scan(i8* dataptr, i32 stride): the scalar scan loop.
+    {
+        llvm::Function* fn = runtime.scan_fn;
+        fn->setLinkage(llvm::GlobalValue::InternalLinkage);
+        llvm::Function::arg_iterator args = fn->arg_begin();
+        llvm::Argument* dataptr = &*args++;
+        llvm::Argument* stride = &*args++;
+        llvm::BasicBlock* entry_block = llvm::BasicBlock::Create(context, "entry", fn);
+        llvm::BasicBlock* header_block = llvm::BasicBlock::Create(context, "header", fn);
+        llvm::BasicBlock* body_block = llvm::BasicBlock::Create(context, "body", fn);
+        llvm::BasicBlock* exit_block = llvm::BasicBlock::Create(context, "exit", fn);
+        llvm::IRBuilder<> builder(entry_block);
+        builder.CreateBr(header_block);
+
+        builder.SetInsertPoint(header_block);
+        llvm::PHINode* header_dataptr = builder.CreatePHI(int8_ptr_type, 2, "dataptr");
+        header_dataptr->addIncoming(dataptr, entry_block);
+        llvm::Value* element = builder.CreateLoad(header_dataptr, "element");
+        builder.CreateCondBr(builder.CreateICmpEQ(element, builder.getInt8(0)),
+                             exit_block, body_block);
+
+        builder.SetInsertPoint(body_block);
+        llvm::Value* moved_dataptr =
+            builder.CreateInBoundsGEP(header_dataptr, stride, "moved_dataptr");
+        header_dataptr->addIncoming(moved_dataptr, body_block);
+        builder.CreateBr(header_block);
+
+        builder.SetInsertPoint(exit_block);
+        builder.CreateRet(header_dataptr);
+    }
+
+    // i32 main(): run the program on memory from calloc, which the kernel hands
+    // out zeroed and only backs with pages as the program touches them.
+    {
+        llvm::Function* jit_fn = module->getFunction(JIT_FUNC_NAME);
+        assert(jit_fn && "emit_jit_function must be called first");
+        llvm::Function* main_fn = llvm::Function::Create(
+            llvm::FunctionType::get(int32_type, false), llvm::Function::ExternalLinkage,
+            "main", module);
+        llvm::BasicBlock* entry_block =
+            llvm::BasicBlock::Create(context, "entry", main_fn);
+        llvm::BasicBlock* run_block = llvm::BasicBlock::Create(context, "run", main_fn);
+        llvm::BasicBlock* fail_block = llvm::BasicBlock::Create(context, "fail", main_fn);
+        llvm::IRBuilder<> builder(entry_block);
+        llvm::Value* memory = builder.CreateCall(
+            calloc_fn, { builder.getInt64(memory_size), builder.getInt64(1) }, "memory");
+        builder.CreateCondBr(builder.CreateIsNull(memory), fail_block, run_block);
+
+        builder.SetInsertPoint(run_block);
+        builder.CreateCall(jit_fn, { memory, builder.getInt64(memory_size) });
+        builder.CreateRet(builder.getInt32(0));
+
+        builder.SetInsertPoint(fail_block);
+        builder.CreateRet(builder.getInt32(1));
+    }
+}
+
+/// The optimization pipelines the JIT can run over the emitted IR.
+enum class BFPipeline
+{
+    O0,
+    O1,
+    O2,
+    O3,
+    /// A handful of cheap function passes that clean up what emit_ops leaves
+    /// behind, e.g. loads and stores of the same cell on both sides of an I/O op.
+    Minimal,
+};
+
+inline const char* pipeline_name(BFPipeline pipeline)
+{
+    switch (pipeline)
+    {
+    case BFPipeline::O0:
+        return "O0";
+    case BFPipeline::O1:
+        return "O1";
+    case BFPipeline::O2:
+        return "O2";
+    case BFPipeline::O3:
+        return "O3";
+    case BFPipeline::Minimal:
+        return "minimal";
+    }
+    return "unknown";
+}
+
+/// The code generator optimization level that goes with a pipeline.
+inline llvm::CodeGenOpt::Level codegen_opt_level(BFPipeline pipeline)
+{
+    switch (pipeline)
+    {
+    case BFPipeline::O0:
+        return llvm::CodeGenOpt::None;
+    case BFPipeline::O1:
+    case BFPipeline::Minimal:
+        return llvm::CodeGenOpt::Less;
+    case BFPipeline::O2:
+        return llvm::CodeGenOpt::Default;
+    case BFPipeline::O3:
+        return llvm::CodeGenOpt::Aggressive;
+    }
+    return llvm::CodeGenOpt::Default;
+}
+
+/// Run the given pipeline over every function in the module. With
+/// `inline_functions`, every pipeline but O0 also runs the inliner, which only
+/// pays off when the module defines the functions it calls, as a module with a
+/// standalone runtime does.
+inline void optimize_module(llvm::Module* module, BFPipeline pipeline,
+                            bool inline_functions = false)
+{
+    if (pipeline == BFPipeline::O0)
+        return;
+
+    llvm::legacy::FunctionPassManager function_pm(module);
+    llvm::legacy::PassManager module_pm;
+    if (pipeline == BFPipeline::Minimal)
+    {
+        function_pm.add(llvm::createEarlyCSEPass());
+        function_pm.add(llvm::createInstructionCombiningPass());
+        function_pm.add(llvm::createDeadStoreEliminationPass());
+        function_pm.add(llvm::createCFGSimplificationPass());
+        if (inline_functions)
+            module_pm.add(llvm::createFunctionInliningPass(1, 0, false));
+    }
+    else
+    {
+        llvm::PassManagerBuilder pm_builder;
+        pm_builder.OptLevel = static_cast<unsigned>(pipeline);
+        pm_builder.SizeLevel = 0;
+        if (inline_functions)
+            pm_builder.Inliner =
+                llvm::createFunctionInliningPass(pm_builder.OptLevel, 0, false);
+        pm_builder.populateFunctionPassManager(function_pm);
+        pm_builder.populateModulePassManager(module_pm);
+    }
+
+    function_pm.doInitialization();
+    for (llvm::Function& fn : *module)
+    {
+        if (!fn.isDeclaration())
+            function_pm.run(fn);
+    }
+    function_pm.doFinalization();
+    module_pm.run(*module);
+}
+
+#endif  // BRAINFUCK_CODEGEN_H
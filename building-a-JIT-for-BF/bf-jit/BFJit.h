@@ -2,10 +2,15 @@
 #define BRAINFUCK_JIT_H
 
 #include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <functional>
 #include <llvm/ADT/STLExtras.h>
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
 #include <llvm/ExecutionEngine/JITSymbol.h>
+#include <llvm/ExecutionEngine/ObjectCache.h>
 #include <llvm/ExecutionEngine/Orc/CompileUtils.h>
+#include <llvm/ExecutionEngine/Orc/IndirectionUtils.h>
 #include <llvm/ExecutionEngine/Orc/IRCompileLayer.h>
 #include <llvm/ExecutionEngine/Orc/LambdaResolver.h>
 #include <llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h>
@@ -14,8 +19,11 @@
 #include <llvm/IR/DataLayout.h>
 #include <llvm/IR/Mangler.h>
 #include <llvm/Support/DynamicLibrary.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Target/TargetMachine.h>
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
@@ -30,16 +38,27 @@ private:
     llvm::orc::RTDyldObjectLinkingLayer ObjectLayer;
     llvm::orc::IRCompileLayer<decltype(ObjectLayer), llvm::orc::SimpleCompiler>
         CompileLayer;
+    // Host functions that JIT-compiled code may call, keyed by mangled name.
+    std::map<std::string, llvm::JITTargetAddress> RuntimeSymbols;
+    std::unique_ptr<llvm::orc::JITCompileCallbackManager> CompileCallbackMgr;
+    std::unique_ptr<llvm::orc::IndirectStubsManager> IndirectStubsMgr;
 
 public:
-    BrainfuckJIT()
+    /// If ObjCache is given, every module compiled by the JIT is also handed to it.
+    explicit BrainfuckJIT(llvm::ObjectCache *ObjCache = nullptr)
         : Resolver(llvm::orc::createLegacyLookupResolver(
               ES,
               [this](const std::string &Name) -> llvm::JITSymbol {
+                  if (auto Sym = IndirectStubsMgr->findStub(Name, false))
+                      return Sym;
                   if (auto Sym = CompileLayer.findSymbol(Name, false))
                       return Sym;
                   else if (auto Err = Sym.takeError())
                       return std::move(Err);
+                  auto RuntimeSym = RuntimeSymbols.find(Name);
+                  if (RuntimeSym != RuntimeSymbols.end())
+                      return llvm::JITSymbol(RuntimeSym->second,
+                                             llvm::JITSymbolFlags::Exported);
                   if (auto SymAddr =
                           llvm::RTDyldMemoryManager::getSymbolAddressInProcess(Name))
                       return llvm::JITSymbol(SymAddr, llvm::JITSymbolFlags::Exported);
@@ -54,8 +73,13 @@ public:
                               std::make_shared<llvm::SectionMemoryManager>(), Resolver
                           };
                       }),
-          CompileLayer(ObjectLayer, llvm::orc::SimpleCompiler(*TM))
+          CompileLayer(ObjectLayer, llvm::orc::SimpleCompiler(*TM, ObjCache)),
+          CompileCallbackMgr(
+              llvm::orc::createLocalCompileCallbackManager(TM->getTargetTriple(), ES, 0))
     {
+        auto IndirectStubsMgrBuilder =
+            llvm::orc::createLocalIndirectStubsManagerBuilder(TM->getTargetTriple());
+        IndirectStubsMgr = IndirectStubsMgrBuilder();
         llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
     }
 
@@ -72,12 +96,53 @@ public:
         return K;
     }
 
+    llvm::orc::VModuleKey addObject(std::unique_ptr<llvm::MemoryBuffer> Obj)
+    {
+        // Add an already compiled object file, bypassing the compile layer.
+        auto K = ES.allocateVModule();
+        llvm::cantFail(ObjectLayer.addObject(K, std::move(Obj)));
+        return K;
+    }
+
+    /// Define the function Name as a stub that is only compiled when it is first
+    /// called. Materialize must return a module that defines the body of the
+    /// function under the name it is given; the module is compiled on that first
+    /// call, and the stub jumps straight to the body from then on.
+    void addLazyFunction(
+        const std::string Name,
+        std::function<std::unique_ptr<llvm::Module>(const std::string &)> Materialize)
+    {
+        std::string ImplName = Name + "$impl";
+        auto CompileAction = [this, Name, ImplName,
+                              Materialize]() -> llvm::JITTargetAddress {
+            addModule(Materialize(ImplName));
+            llvm::JITTargetAddress ImplAddr = getSymbolAddress(ImplName);
+            assert(ImplAddr && "Couldn't find compiled function?");
+            if (auto Err = IndirectStubsMgr->updatePointer(mangle(Name), ImplAddr))
+            {
+                llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(),
+                                            "Error updating function pointer: ");
+                exit(1);
+            }
+            // Returning the body's address resumes the call that hit the stub.
+            return ImplAddr;
+        };
+        auto CallbackAddr =
+            llvm::cantFail(CompileCallbackMgr->getCompileCallback(CompileAction));
+        llvm::cantFail(IndirectStubsMgr->createStub(mangle(Name), CallbackAddr,
+                                                    llvm::JITSymbolFlags::Exported));
+    }
+
+    void addRuntimeSymbol(const std::string Name, void *Addr)
+    {
+        // Resolve references to Name in JIT-compiled code to Addr.
+        RuntimeSymbols[mangle(Name)] = static_cast<llvm::JITTargetAddress>(
+            reinterpret_cast<uintptr_t>(Addr));
+    }
+
     llvm::JITSymbol findSymbol(const std::string Name)
     {
-        std::string MangledName;
-        llvm::raw_string_ostream MangledNameStream(MangledName);
-        llvm::Mangler::getNameWithPrefix(MangledNameStream, Name, DL);
-        return CompileLayer.findSymbol(MangledNameStream.str(), true);
+        return CompileLayer.findSymbol(mangle(Name), true);
     }
 
     llvm::JITTargetAddress getSymbolAddress(const std::string Name)
@@ -85,6 +150,22 @@ public:
         return llvm::cantFail(findSymbol(Name).getAddress());
     }
 
+    llvm::JITTargetAddress getSymbolAddressIn(llvm::orc::VModuleKey K,
+                                              const std::string Name)
+    {
+        // Look Name up in module K only, so that several modules may define it.
+        auto Sym = CompileLayer.findSymbolIn(K, mangle(Name), true);
+        return llvm::cantFail(Sym.getAddress());
+    }
+
+    std::string mangle(const std::string &Name)
+    {
+        std::string MangledName;
+        llvm::raw_string_ostream MangledNameStream(MangledName);
+        llvm::Mangler::getNameWithPrefix(MangledNameStream, Name, DL);
+        return MangledNameStream.str();
+    }
+
     void removeModule(llvm::orc::VModuleKey K)
     {
         llvm::cantFail(CompileLayer.removeModule(K));
@@ -0,0 +1,247 @@
+#ifndef BRAINFUCK_KERNELS_H
+#define BRAINFUCK_KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Vector kernels are built for x86-64 with GCC-compatible compilers; SSE2 is part
+// of the base ISA there, AVX2 is used when the CPU supports it.
+#if defined(__x86_64__) && defined(__GNUC__)
+#define BF_X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define BF_X86_KERNELS 0
+#endif
+
+/// A scan kernel returns the first cell at dataptr + k * stride, k >= 0, that is
+/// zero. Like the "[>]"-style loops it replaces it does not check bounds: the
+/// caller guarantees that such a cell exists (or that running off the memory
+/// faults, as on a BFTape).
+using BFScanKernel = uint8_t* (*)(uint8_t* dataptr, int32_t stride);
+
+inline uint8_t* bf_scan_scalar(uint8_t* dataptr, int32_t stride)
+{
+    while (*dataptr != 0)
+        dataptr += stride;
+    return dataptr;
+}
+
+/// The cells a scan with this stride visits in an aligned block of 32 cells, as a
+/// bit mask for a scan whose start is aligned, or 0 if the vector kernels do not
+/// handle the stride. Only strides that divide the block size qualify, so the
+/// pattern is the same in every block.
+inline uint32_t scan_stride_pattern(int32_t stride)
+{
+    switch (stride < 0 ? -stride : stride)
+    {
+    case 1:
+        return 0xFFFFFFFFu;
+    case 2:
+        return 0x55555555u;
+    case 4:
+        return 0x11111111u;
+    case 8:
+        return 0x01010101u;
+    default:
+        return 0;
+    }
+}
+
+#if BF_X86_KERNELS
+// The vector kernels only ever load whole aligned blocks. An aligned block never
+// straddles a page, so it is readable whenever the cell the scan is at is, and
+// the next block is only loaded when the scalar loop would also have entered it.
+// The SSE2 and AVX2 kernels differ only in block width and intrinsics; the AVX2
+// one needs a target attribute, which a template cannot add, hence the macro.
+#define BF_DEFINE_SCAN_KERNEL(NAME, TARGET, WIDTH, VECTOR, LOAD, CMPEQ, MOVEMASK,    \
+                              ZERO)                                                \
+    TARGET inline uint8_t* NAME(uint8_t* dataptr, int32_t stride)                  \
+    {                                                                              \
+        const uint32_t width_mask = WIDTH == 32 ? 0xFFFFFFFFu : 0xFFFFu;           \
+        uint32_t pattern = scan_stride_pattern(stride) & width_mask;               \
+        if (pattern == 0)                                                          \
+            return bf_scan_scalar(dataptr, stride);                                \
+        uintptr_t address = reinterpret_cast<uintptr_t>(dataptr);                  \
+        uint32_t start = static_cast<uint32_t>(address & (WIDTH - 1));             \
+        const uint8_t* block =                                                     \
+            reinterpret_cast<const uint8_t*>(address - start);                     \
+        pattern = (pattern << (start % (stride < 0 ? -stride : stride))) &         \
+                  width_mask;                                                      \
+        const VECTOR zero = ZERO();                                                \
+        if (stride > 0)                                                            \
+        {                                                                          \
+            uint32_t mask = pattern & (width_mask << start);                       \
+            for (;;)                                                               \
+            {                                                                      \
+                VECTOR cells = LOAD(reinterpret_cast<const VECTOR*>(block));       \
+                uint32_t zeros =                                                   \
+                    static_cast<uint32_t>(MOVEMASK(CMPEQ(cells, zero))) & mask;    \
+                if (zeros != 0)                                                    \
+                    return const_cast<uint8_t*>(block) + __builtin_ctz(zeros);     \
+                block += WIDTH;                                                    \
+                mask = pattern;                                                    \
+            }                                                                      \
+        }                                                                          \
+        uint32_t mask = pattern & (width_mask >> (WIDTH - 1 - start));             \
+        for (;;)                                                                   \
+        {                                                                          \
+            VECTOR cells = LOAD(reinterpret_cast<const VECTOR*>(block));           \
+            uint32_t zeros =                                                       \
+                static_cast<uint32_t>(MOVEMASK(CMPEQ(cells, zero))) & mask;        \
+            if (zeros != 0)                                                        \
+                return const_cast<uint8_t*>(block) + (31 - __builtin_clz(zeros));  \
+            block -= WIDTH;                                                        \
+            mask = pattern;                                                        \
+        }                                                                          \
+    }
+
+BF_DEFINE_SCAN_KERNEL(bf_scan_sse2, , 16, __m128i, _mm_load_si128, _mm_cmpeq_epi8,
+                      _mm_movemask_epi8, _mm_setzero_si128)
+BF_DEFINE_SCAN_KERNEL(bf_scan_avx2, __attribute__((target("avx2"))), 32, __m256i,
+                      _mm256_load_si256, _mm256_cmpeq_epi8, _mm256_movemask_epi8,
+                      _mm256_setzero_si256)
+#undef BF_DEFINE_SCAN_KERNEL
+#endif
+
+/// The fastest scan kernel the CPU supports.
+inline BFScanKernel select_scan_kernel()
+{
+#if BF_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return &bf_scan_avx2;
+    return &bf_scan_sse2;
+#else
+    return &bf_scan_scalar;
+#endif
+}
+
+/// Scan for a zero cell with the kernel picked for this CPU. The interpreter calls
+/// this through scan_cells, JIT-compiled code through the runtime (see
+/// BFRuntime.h).
+inline uint8_t* bf_scan(uint8_t* dataptr, int32_t stride)
+{
+    static const BFScanKernel kernel = select_scan_kernel();
+    return kernel(dataptr, stride);
+}
+
+/// Scan a tape of `Cell`s. Only 8-bit tapes have vector kernels; wider cells are
+/// scanned by the scalar loop.
+template <typename Cell>
+inline Cell* scan_cells(Cell* dataptr, int32_t stride)
+{
+    while (*dataptr != 0)
+        dataptr += stride;
+    return dataptr;
+}
+
+inline uint8_t* scan_cells(uint8_t* dataptr, int32_t stride)
+{
+    return bf_scan(dataptr, stride);
+}
+
+/// Block kernels update `count` adjacent cells starting at `cells`: an add kernel
+/// adds deltas[i] to cells[i], a clear kernel zeroes them. The interpreter runs
+/// long runs of adds and clears through them.
+using BFAddKernel = void (*)(uint8_t* cells, const uint8_t* deltas, size_t count);
+using BFClearKernel = void (*)(uint8_t* cells, size_t count);
+
+inline void bf_add_scalar(uint8_t* cells, const uint8_t* deltas, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        cells[i] += deltas[i];
+}
+
+inline void bf_clear_scalar(uint8_t* cells, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        cells[i] = 0;
+}
+
+#if BF_X86_KERNELS
+// Runs start anywhere on the tape, so the block kernels use unaligned loads and
+// stores, and leave the cells after the last whole block to the scalar loop.
+#define BF_DEFINE_BLOCK_KERNELS(ADD_NAME, CLEAR_NAME, TARGET, WIDTH, VECTOR, LOADU,   \
+                                STOREU, ADD, ZERO)                                  \
+    TARGET inline void ADD_NAME(uint8_t* cells, const uint8_t* deltas, size_t count) \
+    {                                                                               \
+        size_t i = 0;                                                               \
+        for (; i + WIDTH <= count; i += WIDTH)                                      \
+        {                                                                           \
+            VECTOR* block = reinterpret_cast<VECTOR*>(cells + i);                   \
+            STOREU(block, ADD(LOADU(block),                                         \
+                              LOADU(reinterpret_cast<const VECTOR*>(deltas + i)))); \
+        }                                                                           \
+        bf_add_scalar(cells + i, deltas + i, count - i);                            \
+    }                                                                               \
+    TARGET inline void CLEAR_NAME(uint8_t* cells, size_t count)                     \
+    {                                                                               \
+        const VECTOR zero = ZERO();                                                 \
+        size_t i = 0;                                                               \
+        for (; i + WIDTH <= count; i += WIDTH)                                      \
+            STOREU(reinterpret_cast<VECTOR*>(cells + i), zero);                     \
+        bf_clear_scalar(cells + i, count - i);                                      \
+    }
+
+BF_DEFINE_BLOCK_KERNELS(bf_add_sse2, bf_clear_sse2, , 16, __m128i, _mm_loadu_si128,
+                        _mm_storeu_si128, _mm_add_epi8, _mm_setzero_si128)
+BF_DEFINE_BLOCK_KERNELS(bf_add_avx2, bf_clear_avx2, __attribute__((target("avx2"))),
+                        32, __m256i, _mm256_loadu_si256, _mm256_storeu_si256,
+                        _mm256_add_epi8, _mm256_setzero_si256)
+#undef BF_DEFINE_BLOCK_KERNELS
+#endif
+
+/// The fastest block kernels the CPU supports.
+struct BFBlockKernels
+{
+    BFAddKernel add;
+    BFClearKernel clear;
+};
+
+inline BFBlockKernels select_block_kernels()
+{
+#if BF_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return BFBlockKernels{ &bf_add_avx2, &bf_clear_avx2 };
+    return BFBlockKernels{ &bf_add_sse2, &bf_clear_sse2 };
+#else
+    return BFBlockKernels{ &bf_add_scalar, &bf_clear_scalar };
+#endif
+}
+
+inline const BFBlockKernels& bf_block_kernels()
+{
+    static const BFBlockKernels kernels = select_block_kernels();
+    return kernels;
+}
+
+/// Add `deltas` to a run of `count` cells of type `Cell`. Only 8-bit tapes have
+/// vector kernels; wider cells are updated by the scalar loop.
+template <typename Cell>
+inline void add_cells(Cell* cells, const Cell* deltas, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        cells[i] += deltas[i];
+}
+
+inline void add_cells(uint8_t* cells, const uint8_t* deltas, size_t count)
+{
+    bf_block_kernels().add(cells, deltas, count);
+}
+
+/// Zero a run of `count` cells of type `Cell`, with the clear kernel on 8-bit
+/// tapes.
+template <typename Cell>
+inline void clear_cells(Cell* cells, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        cells[i] = 0;
+}
+
+inline void clear_cells(uint8_t* cells, size_t count)
+{
+    bf_block_kernels().clear(cells, count);
+}
+
+#endif  // BRAINFUCK_KERNELS_H
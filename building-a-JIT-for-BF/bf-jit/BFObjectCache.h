@@ -0,0 +1,97 @@
+#ifndef BRAINFUCK_OBJECT_CACHE_H
+#define BRAINFUCK_OBJECT_CACHE_H
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/ExecutionEngine/ObjectCache.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+#include <memory>
+#include <string>
+
+/// Persistent on-disk cache of compiled BF programs. Each object file is stored
+/// as <dir>/<key>.o, where the key is also used as the module identifier, so the
+/// cache can be consulted both before any IR is emitted (getCachedObject) and by
+/// SimpleCompiler after a module has been compiled (notifyObjectCompiled).
+class BFObjectCache : public llvm::ObjectCache
+{
+public:
+    /// Bump this whenever the code emitted for a given program changes, so that
+    /// objects written by an older bf-jit are never picked up.
+    static constexpr unsigned FORMAT_VERSION = 7;
+
+    explicit BFObjectCache(const std::string& dir) : dir_(dir)
+    {
+        llvm::sys::fs::create_directories(dir_);
+    }
+
+    /// Compute the cache key of a program from its normalized instruction string,
+    /// the target triple, the optimization pipeline and any other options that
+    /// change the emitted code.
+    static std::string computeKey(llvm::StringRef instructions, llvm::StringRef triple,
+                                  llvm::StringRef pipeline, llvm::StringRef options)
+    {
+        llvm::MD5 hash;
+        hash.update(instructions);
+        hash.update(llvm::StringRef("", 1));
+        hash.update(triple);
+        hash.update(llvm::StringRef("", 1));
+        hash.update(options);
+        hash.update(llvm::StringRef("", 1));
+        hash.update(pipeline);
+        hash.update("/v" + std::to_string(FORMAT_VERSION));
+        llvm::MD5::MD5Result result;
+        hash.final(result);
+        llvm::SmallString<32> digest;
+        llvm::MD5::stringifyResult(result, digest);
+        return "bf_" + digest.str().str();
+    }
+
+    /// Return the object stored under `key`, or nullptr on a cache miss.
+    std::unique_ptr<llvm::MemoryBuffer> getCachedObject(llvm::StringRef key)
+    {
+        llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer =
+            llvm::MemoryBuffer::getFile(getObjectPath(key), -1, false);
+        if (!buffer)
+            return nullptr;
+        return std::move(*buffer);
+    }
+
+    std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module* M) override
+    {
+        return getCachedObject(M->getModuleIdentifier());
+    }
+
+    /// Write the object to a temporary file first and rename it into place, so
+    /// concurrent runs never observe a partially written object.
+    void notifyObjectCompiled(const llvm::Module* M, llvm::MemoryBufferRef Obj) override
+    {
+        std::string path = getObjectPath(M->getModuleIdentifier());
+        int fd;
+        llvm::SmallString<128> temp_path;
+        if (llvm::sys::fs::createUniqueFile(path + "-%%%%%%.tmp", fd, temp_path))
+            return;
+        {
+            llvm::raw_fd_ostream os(fd, /*shouldClose=*/true);
+            os << Obj.getBuffer();
+        }
+        if (llvm::sys::fs::rename(temp_path, path))
+            llvm::sys::fs::remove(temp_path);
+    }
+
+private:
+    std::string getObjectPath(llvm::StringRef key) const
+    {
+        llvm::SmallString<128> path(dir_);
+        llvm::sys::path::append(path, key + ".o");
+        return path.str().str();
+    }
+
+    std::string dir_;
+};
+
+#endif  // BRAINFUCK_OBJECT_CACHE_H
@@ -0,0 +1,135 @@
+#ifndef BRAINFUCK_PROFILE_H
+#define BRAINFUCK_PROFILE_H
+
+#include "BFProgram.h"
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/// Execution counts of a profiled run, indexed like BFProgram::ops: counts[i] is
+/// the number of ops executed at ops[i]. The interpreter counts every op where it
+/// runs; JIT-compiled code attributes a whole straight-line block to the block's
+/// first op. Brackets are always counted on their own, so the count of a LoopEnd
+/// is the number of iterations of its loop.
+using BFProfileCounts = std::vector<uint64_t>;
+
+/// What a profile says about one loop.
+struct BFLoopProfile
+{
+    size_t begin;         // Index of the LoopBegin op
+    uint32_t source;      // Offset of the '[' in BFProgram::instructions
+    unsigned depth;       // 1 for outermost loops
+    uint64_t iterations;  // Times the body ran
+    uint64_t self_ops;    // Ops executed in the loop but outside its inner loops
+    uint64_t total_ops;   // Ops executed in the loop, inner loops included
+    std::string stack;    // Frames from the program down to this loop, ';'-separated
+    /// Line and column of the '[' in the source file.
+    BFSourceLocation location;
+};
+
+/// Summarize `counts` per loop, in program order. `program_ops` receives the ops
+/// executed outside of any loop.
+inline std::vector<BFLoopProfile> analyze_profile(const BFProgram& program,
+                                                  const BFProfileCounts& counts,
+                                                  uint64_t& program_ops)
+{
+    assert(counts.size() >= program.ops.size());
+    std::vector<BFLoopProfile> loops;
+    // Loops enclosing the current op, as indices into `loops`.
+    std::vector<size_t> open_loops;
+    program_ops = 0;
+    for (size_t pc = 0; pc < program.ops.size(); ++pc)
+    {
+        const BFOp& op = program.ops[pc];
+        // The '[' test runs in the enclosing loop, the ']' test in the loop itself.
+        uint64_t& self_ops =
+            open_loops.empty() ? program_ops : loops[open_loops.back()].self_ops;
+        self_ops += counts[pc];
+        if (op.kind == BFOpKind::LoopBegin)
+        {
+            BFLoopProfile loop;
+            loop.begin = pc;
+            loop.source = op.source;
+            loop.location = command_location(program, op.source);
+            loop.depth = static_cast<unsigned>(open_loops.size()) + 1;
+            loop.iterations = counts[op.match];
+            loop.self_ops = 0;
+            loop.total_ops = 0;
+            loop.stack = (open_loops.empty() ? std::string("program")
+                                             : loops[open_loops.back()].stack) +
+                         ";loop@" + std::to_string(loop.location.line) + ":" +
+                         std::to_string(loop.location.column);
+            open_loops.push_back(loops.size());
+            loops.push_back(loop);
+        }
+        else if (op.kind == BFOpKind::LoopEnd)
+        {
+            BFLoopProfile& loop = loops[open_loops.back()];
+            open_loops.pop_back();
+            loop.total_ops += loop.self_ops;
+            if (!open_loops.empty())
+                loops[open_loops.back()].total_ops += loop.total_ops;
+        }
+    }
+    return loops;
+}
+
+/// Write the profile in the collapsed stack format of flamegraph.pl and similar
+/// tools: one line per loop with the stack of loops leading to it, named after the
+/// line and column of their '[', and the ops executed directly in it.
+inline void write_flame_graph(const BFProgram& program, const BFProfileCounts& counts,
+                              std::ostream& os)
+{
+    uint64_t program_ops;
+    std::vector<BFLoopProfile> loops = analyze_profile(program, counts, program_ops);
+    if (program_ops != 0)
+        os << "program " << program_ops << "\n";
+    for (const BFLoopProfile& loop : loops)
+    {
+        if (loop.self_ops != 0)
+            os << loop.stack << " " << loop.self_ops << "\n";
+    }
+}
+
+/// Write a table of the `limit` loops with the largest share of executed ops, inner
+/// loops included.
+inline void write_hot_loops(const BFProgram& program, const BFProfileCounts& counts,
+                            std::ostream& os, size_t limit = 20)
+{
+    uint64_t program_ops;
+    std::vector<BFLoopProfile> loops = analyze_profile(program, counts, program_ops);
+    uint64_t total_ops = program_ops;
+    for (const BFLoopProfile& loop : loops)
+    {
+        if (loop.depth == 1)
+            total_ops += loop.total_ops;
+    }
+    std::stable_sort(loops.begin(), loops.end(),
+                     [](const BFLoopProfile& a, const BFLoopProfile& b) {
+                         return a.total_ops > b.total_ops;
+                     });
+    if (loops.size() > limit)
+        loops.resize(limit);
+
+    char line[128];
+    os << "===-- profile: " << total_ops << " ops executed --===\n";
+    snprintf(line, sizeof(line), "%12s %8s %6s %20s\n", "line:col", "share", "depth",
+             "iterations");
+    os << line;
+    for (const BFLoopProfile& loop : loops)
+    {
+        double share = total_ops != 0 ? 100.0 * loop.total_ops / total_ops : 0;
+        char where[32];
+        snprintf(where, sizeof(where), "%zu:%zu", loop.location.line,
+                 loop.location.column);
+        snprintf(line, sizeof(line), "%12s %7.2f%% %6u %20llu\n", where, share,
+                 loop.depth, static_cast<unsigned long long>(loop.iterations));
+        os << line;
+    }
+}
+
+#endif  // BRAINFUCK_PROFILE_H
@@ -0,0 +1,469 @@
+#ifndef BRAINFUCK_PROGRAM_H
+#define BRAINFUCK_PROGRAM_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <istream>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// Number of cells in the memory (tape) of a BF program.
+constexpr int MEMORY_SIZE = 30000;
+
+/// What ',' stores in the cell when the input is exhausted.
+enum class BFEofMode : uint8_t
+{
+    Zero,       // 0
+    MinusOne,   // -1, i.e. all bits set; the default
+    Unchanged,  // Leave the cell as it is
+};
+
+/// Kinds of operations in the BF front-end IR. Every cell access carries an
+/// offset relative to the current data pointer, so runs of '>' and '<' only
+/// materialize as a Move right before a bracket.
+enum class BFOpKind : uint8_t
+{
+    Add,        // memory[dataptr + offset] += count
+    Move,       // dataptr += count
+    Output,     // putchar(memory[dataptr + offset])
+    Input,      // memory[dataptr + offset] = getchar()
+    LoopBegin,  // if (memory[dataptr] == 0) goto match + 1
+    LoopEnd,    // if (memory[dataptr] != 0) goto match + 1
+    // The following ops are only produced by recognize_loop_idioms.
+    Clear,   // memory[dataptr + offset] = 0
+    MulAdd,  // if (memory[dataptr] != 0)
+             //     memory[dataptr + offset] += memory[dataptr] * count
+    Scan,    // while (memory[dataptr] != 0) dataptr += count
+};
+
+struct BFOp
+{
+    BFOpKind kind;
+    int32_t count;   // Add: delta to the cell, Move/Scan: distance to move the data
+                     // pointer, MulAdd: factor
+    int32_t offset;  // Cell offset relative to the current data pointer
+    uint32_t source;  // Index in BFProgram::instructions of the command the op
+                      // starts at; ops lowered from a loop share its '['
+    size_t match;     // LoopBegin/LoopEnd: index of the matching bracket op
+
+    BFOp(BFOpKind kind, int32_t count = 0, int32_t offset = 0)
+        : kind(kind), count(count), offset(offset), source(0), match(0)
+    {
+    }
+};
+
+struct BFProgram
+{
+    /// The raw instruction stream, with all non-command characters removed.
+    std::string instructions;
+    /// The coalesced front-end IR built from `instructions`.
+    std::vector<BFOp> ops;
+    /// Source map: the byte offset in the source of every command in
+    /// `instructions`, and of the start of every line but the first. See
+    /// source_location.
+    std::vector<uint32_t> source_offsets;
+    std::vector<uint32_t> line_starts;
+};
+
+/// Build the front-end IR from the raw instruction stream. Runs of '+'/'-' on
+/// the same cell become a single Add, runs of '>'/'<' are folded into the
+/// offsets of the following ops and only emitted as a Move at a loop boundary.
+inline std::vector<BFOp> build_ops(const std::string& instructions)
+{
+    std::vector<BFOp> ops;
+    std::vector<size_t> open_brackets;
+    // Ops at or after this index belong to the current straight-line segment
+    // and may be merged with.
+    size_t segment_begin = 0;
+    int32_t pending_offset = 0;
+
+    uint32_t source = 0;
+    auto push = [&](BFOp op) {
+        op.source = source;
+        ops.push_back(op);
+    };
+    auto flush_move = [&]() {
+        if (pending_offset != 0)
+            push(BFOp(BFOpKind::Move, pending_offset));
+        pending_offset = 0;
+    };
+
+    for (; source < instructions.size(); ++source)
+    {
+        char c = instructions[source];
+        switch (c)
+        {
+        case '>':
+            pending_offset++;
+            break;
+        case '<':
+            pending_offset--;
+            break;
+        case '+':
+        case '-':
+        {
+            int32_t delta = c == '+' ? 1 : -1;
+            if (ops.size() > segment_begin && ops.back().kind == BFOpKind::Add &&
+                ops.back().offset == pending_offset)
+            {
+                ops.back().count += delta;
+                // Adds that cancel out, e.g. "+-", disappear entirely.
+                if (ops.back().count == 0)
+                    ops.pop_back();
+            }
+            else
+            {
+                push(BFOp(BFOpKind::Add, delta, pending_offset));
+            }
+            break;
+        }
+        case '.':
+            push(BFOp(BFOpKind::Output, 0, pending_offset));
+            break;
+        case ',':
+            push(BFOp(BFOpKind::Input, 0, pending_offset));
+            break;
+        case '[':
+            flush_move();
+            open_brackets.push_back(ops.size());
+            push(BFOp(BFOpKind::LoopBegin));
+            segment_begin = ops.size();
+            break;
+        case ']':
+        {
+            flush_move();
+            assert(!open_brackets.empty() && "unbalanced ']'");
+            size_t begin = open_brackets.back();
+            open_brackets.pop_back();
+            ops[begin].match = ops.size();
+            push(BFOp(BFOpKind::LoopEnd));
+            ops.back().match = begin;
+            segment_begin = ops.size();
+            break;
+        }
+        default:
+            break;
+        }
+    }
+    assert(open_brackets.empty() && "unbalanced '['");
+    flush_move();
+    return ops;
+}
+
+/// Recompute the `match` fields of all bracket ops.
+inline void link_brackets(std::vector<BFOp>& ops)
+{
+    std::vector<size_t> open_brackets;
+    for (size_t i = 0; i < ops.size(); ++i)
+    {
+        if (ops[i].kind == BFOpKind::LoopBegin)
+        {
+            open_brackets.push_back(i);
+        }
+        else if (ops[i].kind == BFOpKind::LoopEnd)
+        {
+            size_t begin = open_brackets.back();
+            open_brackets.pop_back();
+            ops[begin].match = i;
+            ops[i].match = begin;
+        }
+    }
+    assert(open_brackets.empty());
+}
+
+/// Try to lower the innermost loop ops[begin] .. ops[end] into straight-line ops,
+/// appending them to `out`. Returns false if the loop is not a known idiom.
+///
+/// Recognized idioms:
+/// - Scan loops such as "[>]" or "[<<]": the body is a single Move.
+/// - Clear and multiply loops such as "[-]", "[->+<]" or "[->++>+++<<]": the body
+///   only adds constants to cells, does not move the data pointer and changes the
+///   current cell by exactly +1 or -1 per iteration. Each other cell then receives
+///   the current cell multiplied by a constant, and the current cell ends at 0.
+///   Whether a delta is +-1 depends on the width of the cells, `cell_bits`. The
+///   MulAdds of one loop are adjacent and share its `source`. Like the loop, which
+///   does not run at all then, they leave their cells alone while the current cell
+///   is 0, so a skipped loop never reaches past the ends of the memory.
+inline bool lower_loop_idiom(const std::vector<BFOp>& ops, size_t begin, size_t end,
+                             std::vector<BFOp>& out, unsigned cell_bits = 8)
+{
+    if (end - begin == 2 && ops[begin + 1].kind == BFOpKind::Move)
+    {
+        out.push_back(BFOp(BFOpKind::Scan, ops[begin + 1].count));
+        return true;
+    }
+
+    // Sum up the deltas per offset; std::map keeps the emitted order deterministic.
+    std::map<int32_t, int32_t> deltas;
+    for (size_t i = begin + 1; i < end; ++i)
+    {
+        if (ops[i].kind != BFOpKind::Add)
+            return false;
+        deltas[ops[i].offset] += ops[i].count;
+    }
+    uint32_t cell_mask = cell_bits >= 32 ? 0xFFFFFFFFu : (1u << cell_bits) - 1;
+    uint32_t step_bits = static_cast<uint32_t>(deltas[0]) & cell_mask;
+    int32_t step = step_bits == 1 ? 1 : step_bits == cell_mask ? -1 : 0;
+    if (step != 1 && step != -1)
+        return false;
+
+    // With a step of -1 the loop runs memory[dataptr] times, with a step of +1 it
+    // runs (2^cell_bits - memory[dataptr]) times, which is -memory[dataptr] modulo
+    // 2^cell_bits.
+    for (const auto& delta : deltas)
+    {
+        if (delta.first != 0 && delta.second != 0)
+            out.push_back(BFOp(BFOpKind::MulAdd, -step * delta.second, delta.first));
+    }
+    out.push_back(BFOp(BFOpKind::Clear));
+    return true;
+}
+
+/// Replace innermost loops that match a known idiom with straight-line ops, for
+/// cells of `cell_bits` bits.
+inline std::vector<BFOp> recognize_loop_idioms(const std::vector<BFOp>& ops,
+                                               unsigned cell_bits = 8)
+{
+    std::vector<BFOp> out;
+    out.reserve(ops.size());
+    for (size_t i = 0; i < ops.size(); ++i)
+    {
+        if (ops[i].kind == BFOpKind::LoopBegin)
+        {
+            size_t end = ops[i].match;
+            bool innermost = true;
+            for (size_t j = i + 1; j < end && innermost; ++j)
+                innermost = ops[j].kind != BFOpKind::LoopBegin;
+            size_t lowered = out.size();
+            if (innermost && lower_loop_idiom(ops, i, end, out, cell_bits))
+            {
+                for (; lowered < out.size(); ++lowered)
+                    out[lowered].source = ops[i].source;
+                i = end;
+                continue;
+            }
+        }
+        out.push_back(ops[i]);
+    }
+    link_brackets(out);
+    return out;
+}
+
+/// How a straight-line block accesses one cell.
+struct BFCellAccess
+{
+    int32_t offset;  // Relative to the data pointer at the start of the block
+    bool live_in;    // The block reads the value the cell had before the block
+    bool written;    // The block changes the cell
+};
+
+/// A maximal run ops[begin, end) of Add, Clear, MulAdd and Move ops. Such a run
+/// has no control flow and no I/O, so every cell it touches can be kept in a
+/// register: loaded once on entry if it is live-in and stored once on exit if it
+/// is written.
+struct BFBlock
+{
+    size_t begin;
+    size_t end;
+    int32_t move;  // Net data pointer movement over the block
+    std::vector<BFCellAccess> cells;  // Sorted by offset
+};
+
+inline bool is_block_op(BFOpKind kind)
+{
+    return kind == BFOpKind::Add || kind == BFOpKind::Clear ||
+           kind == BFOpKind::MulAdd || kind == BFOpKind::Move;
+}
+
+/// Analyze the block that starts at ops[begin] and ends at or before ops[end].
+inline BFBlock analyze_block(const std::vector<BFOp>& ops, size_t begin, size_t end)
+{
+    assert(is_block_op(ops[begin].kind));
+    BFBlock block;
+    block.begin = begin;
+    block.move = 0;
+
+    std::map<int32_t, BFCellAccess> cells;
+    auto access = [&](int32_t offset, bool read, bool write) {
+        auto it = cells.find(offset);
+        if (it == cells.end())
+            it = cells.insert(std::make_pair(offset, BFCellAccess{ offset, read, false }))
+                     .first;
+        it->second.written |= write;
+    };
+
+    size_t pc = begin;
+    for (; pc < end && is_block_op(ops[pc].kind); ++pc)
+    {
+        const BFOp& op = ops[pc];
+        int32_t offset = block.move + op.offset;
+        switch (op.kind)
+        {
+        case BFOpKind::Move:
+            block.move += op.count;
+            break;
+        case BFOpKind::Add:
+            access(offset, true, true);
+            break;
+        case BFOpKind::Clear:
+            access(offset, false, true);
+            break;
+        case BFOpKind::MulAdd:
+            access(block.move, true, false);
+            access(offset, true, true);
+            break;
+        default:
+            assert(0 && "unreachable!");
+        }
+    }
+    block.end = pc;
+    for (const auto& cell : cells)
+        block.cells.push_back(cell.second);
+    return block;
+}
+
+/// Split `ops` into straight-line blocks and analyze the cells each of them reads
+/// and writes. Ops outside the returned blocks are brackets, scans and I/O.
+inline std::vector<BFBlock> analyze_tape_access(const std::vector<BFOp>& ops)
+{
+    std::vector<BFBlock> blocks;
+    for (size_t pc = 0; pc < ops.size();)
+    {
+        if (!is_block_op(ops[pc].kind))
+        {
+            ++pc;
+            continue;
+        }
+        blocks.push_back(analyze_block(ops, pc, ops.size()));
+        pc = blocks.back().end;
+    }
+    return blocks;
+}
+
+/// A position in the source of a program. Lines and columns start at 1.
+struct BFSourceLocation
+{
+    size_t offset;  // In bytes from the start of the source
+    size_t line;
+    size_t column;
+};
+
+/// Map a byte offset in the source of `program` to its line and column.
+inline BFSourceLocation source_location(const BFProgram& program, size_t offset)
+{
+    // line_starts holds the start of every line after the first.
+    auto next_line = std::upper_bound(program.line_starts.begin(),
+                                      program.line_starts.end(), offset);
+    size_t line = static_cast<size_t>(next_line - program.line_starts.begin()) + 1;
+    size_t line_start = line == 1 ? 0 : *(next_line - 1);
+    return BFSourceLocation{ offset, line, offset - line_start + 1 };
+}
+
+/// The location of the command program.instructions[index] in the source.
+inline BFSourceLocation command_location(const BFProgram& program, size_t index)
+{
+    return source_location(program, program.source_offsets[index]);
+}
+
+/// Why a program could not be parsed.
+struct BFParseError
+{
+    std::string message;
+    BFSourceLocation location;
+
+    /// "<name>:<line>:<column>: error: <message>", like a compiler diagnostic.
+    std::string describe(const std::string& name) const
+    {
+        return name + ":" + std::to_string(location.line) + ":" +
+               std::to_string(location.column) + ": error: " + message;
+    }
+};
+
+/// Parse the program in `stream` into `program`. The source is read in blocks and
+/// filtered through a lookup table in a single pass, without per-line copies;
+/// brackets are checked as they are read. Returns false with the location of the
+/// first unmatched ']', or of the outermost unmatched '[', in `error`.
+inline bool parse_from_stream(std::istream& stream, BFProgram& program,
+                              BFParseError& error)
+{
+    enum CharClass : uint8_t
+    {
+        OTHER,
+        COMMAND,
+        NEWLINE,
+    };
+    struct CharClassTable
+    {
+        CharClass classes[256];
+        CharClassTable()
+        {
+            std::fill(classes, classes + 256, OTHER);
+            for (unsigned char c : std::string("><+-.,[]"))
+                classes[c] = COMMAND;
+            classes[static_cast<unsigned char>('\n')] = NEWLINE;
+        }
+    };
+    static const CharClassTable table;
+
+    program = BFProgram();
+    std::vector<uint32_t> open_brackets;
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+    std::unique_ptr<char[]> block(new char[BLOCK_SIZE]);
+    uint64_t block_offset = 0;
+    auto fail = [&](const char* message, uint64_t offset) -> bool {
+        error.message = message;
+        error.location = source_location(program, static_cast<size_t>(offset));
+        return false;
+    };
+
+    for (;;)
+    {
+        stream.read(block.get(), BLOCK_SIZE);
+        size_t size = static_cast<size_t>(stream.gcount());
+        if (size == 0)
+            break;
+        // Offsets in the source map are 32-bit.
+        if (block_offset + size > UINT32_MAX)
+            return fail("the program is larger than 4 GiB", block_offset);
+
+        for (size_t i = 0; i < size; ++i)
+        {
+            unsigned char c = static_cast<unsigned char>(block[i]);
+            uint32_t offset = static_cast<uint32_t>(block_offset + i);
+            switch (table.classes[c])
+            {
+            case OTHER:
+                continue;
+            case NEWLINE:
+                program.line_starts.push_back(offset + 1);
+                continue;
+            case COMMAND:
+                break;
+            }
+            if (c == '[')
+            {
+                open_brackets.push_back(offset);
+            }
+            else if (c == ']')
+            {
+                if (open_brackets.empty())
+                    return fail("unmatched ']'", offset);
+                open_brackets.pop_back();
+            }
+            program.instructions.push_back(static_cast<char>(c));
+            program.source_offsets.push_back(offset);
+        }
+        block_offset += size;
+    }
+    if (!open_brackets.empty())
+        return fail("unmatched '['", open_brackets.front());
+
+    program.ops = build_ops(program.instructions);
+    return true;
+}
+
+#endif  // BRAINFUCK_PROGRAM_H
@@ -0,0 +1,90 @@
+#ifndef BRAINFUCK_RUNTIME_H
+#define BRAINFUCK_RUNTIME_H
+
+#include "BFJit.h"
+#include "BFKernels.h"
+#include <cstdint>
+#include <cstdio>
+#include <unistd.h>
+
+/// Size of the output buffer every JIT-compiled module writes into directly, and
+/// of the read-ahead buffer used for input.
+constexpr uint64_t OUTPUT_BUFFER_SIZE = 64 * 1024;
+constexpr uint64_t INPUT_BUFFER_SIZE = 64 * 1024;
+
+const char* const RUNTIME_FLUSH_OUTPUT_NAME = "__bf_flush_output";
+const char* const RUNTIME_READ_INPUT_NAME = "__bf_read_input";
+const char* const RUNTIME_SCAN_NAME = "__bf_scan";
+const char* const RUNTIME_PROFILE_COUNTS_NAME = "__bf_profile_counts";
+
+/// Where the runtime writes output to and reads input from, and the input read
+/// ahead so far.
+struct BFRuntimeIO
+{
+    FILE* output = stdout;
+    int input_fd = STDIN_FILENO;
+    size_t input_pos = 0;
+    size_t input_size = 0;
+    uint8_t input_buffer[INPUT_BUFFER_SIZE];
+};
+
+inline BFRuntimeIO& runtime_io()
+{
+    static BFRuntimeIO io;
+    return io;
+}
+
+/// Point the runtime at other streams, e.g. between the jobs of a batch. Input
+/// read ahead from the previous stream is dropped.
+inline void set_runtime_io(int input_fd, FILE* output)
+{
+    BFRuntimeIO& io = runtime_io();
+    fflush(io.output);
+    io.output = output;
+    io.input_fd = input_fd;
+    io.input_pos = 0;
+    io.input_size = 0;
+}
+
+/// Write out a module's output buffer. The emitted code calls this when the
+/// buffer is full and before it returns, and resets its own buffer size.
+/// fwrite keeps the output ordered with anything else written to the stream.
+inline void bf_flush_output(const uint8_t* buffer, uint64_t size)
+{
+    if (size != 0)
+        fwrite(buffer, 1, size, runtime_io().output);
+}
+
+/// Return the next input byte, or -1 at the end of the input. Input is read in
+/// blocks of up to INPUT_BUFFER_SIZE bytes. Before blocking on a read, the
+/// pending output of the calling module is flushed, so interactive programs see
+/// their prompts.
+inline int32_t bf_read_input(const uint8_t* output_buffer, uint64_t* output_size)
+{
+    BFRuntimeIO& io = runtime_io();
+    if (io.input_pos == io.input_size)
+    {
+        bf_flush_output(output_buffer, *output_size);
+        *output_size = 0;
+        fflush(io.output);
+
+        ssize_t n = read(io.input_fd, io.input_buffer, sizeof(io.input_buffer));
+        if (n <= 0)
+            return -1;
+        io.input_pos = 0;
+        io.input_size = static_cast<size_t>(n);
+    }
+    return io.input_buffer[io.input_pos++];
+}
+
+/// Make the runtime functions visible to code compiled by `jit`.
+inline void add_runtime_symbols(BrainfuckJIT& jit)
+{
+    jit.addRuntimeSymbol(RUNTIME_FLUSH_OUTPUT_NAME,
+                         reinterpret_cast<void*>(&bf_flush_output));
+    jit.addRuntimeSymbol(RUNTIME_READ_INPUT_NAME,
+                         reinterpret_cast<void*>(&bf_read_input));
+    jit.addRuntimeSymbol(RUNTIME_SCAN_NAME, reinterpret_cast<void*>(&bf_scan));
+}
+
+#endif  // BRAINFUCK_RUNTIME_H
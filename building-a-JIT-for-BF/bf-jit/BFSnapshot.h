@@ -0,0 +1,207 @@
+#ifndef BRAINFUCK_SNAPSHOT_H
+#define BRAINFUCK_SNAPSHOT_H
+
+#include "BFProgram.h"
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+/// The execution state of a BF program stopped between two ops: enough to resume
+/// it later, in another process, as if it had never stopped.
+struct BFSnapshot
+{
+    /// Bump this whenever the file layout changes.
+    static constexpr uint32_t FORMAT_VERSION = 1;
+
+    uint64_t program_hash;  // fingerprint_program of the ops the state refers to
+    uint32_t cell_bits;
+    BFEofMode eof;
+    uint64_t pc;            // Index of the op to resume at
+    uint64_t data_ptr;      // Cell index of the data pointer
+    uint64_t input_offset;  // Bytes of input the program has consumed
+    uint64_t tape_size;     // Cells in the memory
+    /// The memory from its first to its last non-zero cell, as little-endian
+    /// cells of cell_bits each; every other cell is zero.
+    uint64_t first_cell;
+    std::vector<uint8_t> cells;
+
+    BFSnapshot()
+        : program_hash(0), cell_bits(8), eof(BFEofMode::MinusOne), pc(0), data_ptr(0),
+          input_offset(0), tape_size(0), first_cell(0)
+    {
+    }
+};
+
+/// A fingerprint of the ops a program runs as, after idiom recognition. A snapshot
+/// only restores into a program with the same fingerprint, since its pc indexes
+/// those ops.
+inline uint64_t fingerprint_program(const std::vector<BFOp>& ops)
+{
+    // 64-bit FNV-1a over the fields that define what an op does.
+    uint64_t hash = 0xcbf29ce484222325ull;
+    auto mix = [&hash](uint32_t value) {
+        for (int i = 0; i < 4; ++i)
+        {
+            hash ^= (value >> (8 * i)) & 0xFF;
+            hash *= 0x100000001b3ull;
+        }
+    };
+    for (const BFOp& op : ops)
+    {
+        mix(static_cast<uint32_t>(op.kind));
+        mix(static_cast<uint32_t>(op.count));
+        mix(static_cast<uint32_t>(op.offset));
+    }
+    return hash;
+}
+
+/// Store the cells of `memory` in `snapshot`, trimmed to their non-zero extent.
+template <typename Cell>
+inline void snapshot_memory(const std::vector<Cell>& memory, BFSnapshot& snapshot)
+{
+    size_t first = 0, last = memory.size();
+    while (first < last && memory[first] == 0)
+        ++first;
+    while (last > first && memory[last - 1] == 0)
+        --last;
+    snapshot.cell_bits = 8 * sizeof(Cell);
+    snapshot.tape_size = memory.size();
+    snapshot.first_cell = first;
+    snapshot.cells.clear();
+    snapshot.cells.reserve((last - first) * sizeof(Cell));
+    for (size_t i = first; i < last; ++i)
+    {
+        for (size_t byte = 0; byte < sizeof(Cell); ++byte)
+            snapshot.cells.push_back(static_cast<uint8_t>(memory[i] >> (8 * byte)));
+    }
+}
+
+/// Load the cells stored in `snapshot` into `memory`, which has its tape_size.
+template <typename Cell>
+inline void restore_memory(const BFSnapshot& snapshot, std::vector<Cell>& memory)
+{
+    std::fill(memory.begin(), memory.end(), 0);
+    Cell* cell = memory.data() + snapshot.first_cell;
+    for (size_t i = 0; i < snapshot.cells.size(); i += sizeof(Cell), ++cell)
+    {
+        uint32_t value = 0;
+        for (size_t byte = 0; byte < sizeof(Cell); ++byte)
+            value |= static_cast<uint32_t>(snapshot.cells[i + byte]) << (8 * byte);
+        *cell = static_cast<Cell>(value);
+    }
+}
+
+namespace bf_snapshot_detail
+{
+const char MAGIC[8] = { 'B', 'F', 'S', 'N', 'A', 'P', '\r', '\n' };
+
+inline void put_u64(std::string& out, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i)
+        out.push_back(static_cast<char>(value >> (8 * i)));
+}
+
+inline bool get_u64(const std::string& in, size_t& pos, uint64_t& value)
+{
+    if (in.size() - pos < 8)
+        return false;
+    value = 0;
+    for (int i = 0; i < 8; ++i)
+        value |= static_cast<uint64_t>(static_cast<uint8_t>(in[pos + i])) << (8 * i);
+    pos += 8;
+    return true;
+}
+}  // namespace bf_snapshot_detail
+
+/// Write `snapshot` to `path`. The file is written under a temporary name and
+/// renamed into place, so a preempted job never leaves a truncated snapshot
+/// behind in place of the previous one.
+inline bool write_snapshot(const std::string& path, const BFSnapshot& snapshot,
+                           std::string& error)
+{
+    using namespace bf_snapshot_detail;
+    std::string data(MAGIC, sizeof(MAGIC));
+    put_u64(data, BFSnapshot::FORMAT_VERSION);
+    put_u64(data, snapshot.program_hash);
+    put_u64(data, snapshot.cell_bits);
+    put_u64(data, static_cast<uint64_t>(snapshot.eof));
+    put_u64(data, snapshot.pc);
+    put_u64(data, snapshot.data_ptr);
+    put_u64(data, snapshot.input_offset);
+    put_u64(data, snapshot.tape_size);
+    put_u64(data, snapshot.first_cell);
+    put_u64(data, snapshot.cells.size());
+    data.append(snapshot.cells.begin(), snapshot.cells.end());
+
+    std::string temp_path = path + ".tmp";
+    {
+        std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+        file.write(data.data(), static_cast<std::streamsize>(data.size()));
+        file.flush();
+        if (!file)
+        {
+            error = "cannot write '" + temp_path + "'";
+            std::remove(temp_path.c_str());
+            return false;
+        }
+    }
+    if (std::rename(temp_path.c_str(), path.c_str()) != 0)
+    {
+        error = "cannot rename '" + temp_path + "' to '" + path + "'";
+        std::remove(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+/// Read a snapshot written by write_snapshot. Only the file itself is checked;
+/// whether it fits a program is up to the interpreter that restores it.
+inline bool read_snapshot(const std::string& path, BFSnapshot& snapshot,
+                          std::string& error)
+{
+    using namespace bf_snapshot_detail;
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        error = "cannot open '" + path + "'";
+        return false;
+    }
+    std::string data((std::istreambuf_iterator<char>(file)),
+                     std::istreambuf_iterator<char>());
+    error = "'" + path + "' is not a valid snapshot";
+    if (data.compare(0, sizeof(MAGIC), std::string(MAGIC, sizeof(MAGIC))) != 0)
+        return false;
+
+    size_t pos = sizeof(MAGIC);
+    uint64_t version, cell_bits, eof, cells_size;
+    if (!get_u64(data, pos, version))
+        return false;
+    if (version != BFSnapshot::FORMAT_VERSION)
+    {
+        error = "'" + path + "' was written by an incompatible version";
+        return false;
+    }
+    if (!get_u64(data, pos, snapshot.program_hash) || !get_u64(data, pos, cell_bits) ||
+        !get_u64(data, pos, eof) || !get_u64(data, pos, snapshot.pc) ||
+        !get_u64(data, pos, snapshot.data_ptr) ||
+        !get_u64(data, pos, snapshot.input_offset) ||
+        !get_u64(data, pos, snapshot.tape_size) ||
+        !get_u64(data, pos, snapshot.first_cell) || !get_u64(data, pos, cells_size))
+        return false;
+    if ((cell_bits != 8 && cell_bits != 16 && cell_bits != 32) ||
+        eof > static_cast<uint64_t>(BFEofMode::Unchanged) ||
+        cells_size != data.size() - pos || cells_size % (cell_bits / 8) != 0 ||
+        snapshot.first_cell > snapshot.tape_size ||
+        cells_size / (cell_bits / 8) > snapshot.tape_size - snapshot.first_cell)
+        return false;
+    snapshot.cell_bits = static_cast<uint32_t>(cell_bits);
+    snapshot.eof = static_cast<BFEofMode>(eof);
+    snapshot.cells.assign(data.begin() + pos, data.end());
+    error.clear();
+    return true;
+}
+
+#endif  // BRAINFUCK_SNAPSHOT_H
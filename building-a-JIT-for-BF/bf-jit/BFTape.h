@@ -0,0 +1,168 @@
+#ifndef BRAINFUCK_TAPE_H
+#define BRAINFUCK_TAPE_H
+
+#include <cassert>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/// The memory (tape) handed to JIT-compiled code. The generated code never checks
+/// the data pointer; instead the tape is an mmap'd region surrounded by PROT_NONE
+/// guard areas:
+///
+///   [ left guard | committed cells ... | reserved, PROT_NONE ... | right guard ]
+///                ^ data()                                        ^ data() + capacity()
+///
+/// Only MEMORY_SIZE-ish cells are committed up front. A fault in the reserved part
+/// commits more pages and resumes the faulting instruction, so programs that need
+/// more than 30000 cells just work. A fault in either guard (moving left of cell 0
+/// or beyond capacity()) terminates the program with a diagnostic.
+class BFTape
+{
+public:
+    /// Reserve `capacity` bytes of address space and commit the first `initial`, or
+    /// as much of it as fits. Check valid() before handing out data(): reserving
+    /// fails for huge tapes or under an address space limit.
+    BFTape(size_t capacity, size_t initial)
+    {
+        page_size_ = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        capacity_ = round_up(capacity);
+        guard_size_ = round_up(GUARD_SIZE);
+        committed_ = 0;
+        base_ = nullptr;
+        data_ = nullptr;
+        size_t total = guard_size_ + capacity_ + guard_size_;
+        if (capacity_ < capacity || total < capacity_)
+            return;
+        void* base = mmap(nullptr, total, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED)
+            return;
+        base_ = static_cast<uint8_t*>(base);
+        data_ = base_ + guard_size_;
+        // Pages past the initial commit are committed on the first fault. If even
+        // the initial ones cannot be, later commits would fail the same way and
+        // every access would be reported as out of the tape.
+        if (!commit(initial < capacity_ ? initial : capacity_))
+        {
+            munmap(base_, total);
+            base_ = nullptr;
+            data_ = nullptr;
+            return;
+        }
+
+        // Only one tape can own the SIGSEGV handler at a time.
+        assert(!active_tape() && "only one BFTape may be alive at a time");
+        active_tape() = this;
+        struct sigaction action = {};
+        action.sa_sigaction = &BFTape::handle_fault;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &previous_segv_);
+        sigaction(SIGBUS, &action, &previous_bus_);
+    }
+
+    BFTape(const BFTape&) = delete;
+    BFTape& operator=(const BFTape&) = delete;
+
+    ~BFTape()
+    {
+        if (!valid())
+            return;
+        sigaction(SIGSEGV, &previous_segv_, nullptr);
+        sigaction(SIGBUS, &previous_bus_, nullptr);
+        active_tape() = nullptr;
+        munmap(base_, guard_size_ + capacity_ + guard_size_);
+    }
+
+    /// Whether the tape could be reserved and committed.
+    bool valid() const
+    {
+        return base_ != nullptr;
+    }
+
+    uint8_t* data() const
+    {
+        return data_;
+    }
+
+    size_t capacity() const
+    {
+        return capacity_;
+    }
+
+private:
+    /// Size of each guard area. Cell offsets folded into a single op may reach
+    /// this far beyond the data pointer and must still land in a guard.
+    static constexpr size_t GUARD_SIZE = 1 << 20;
+
+    size_t round_up(size_t size) const
+    {
+        return (size + page_size_ - 1) / page_size_ * page_size_;
+    }
+
+    /// Make the first `size` bytes of the tape accessible. Fresh anonymous pages
+    /// read as zero, so no memset is needed.
+    bool commit(size_t size)
+    {
+        size = round_up(size);
+        if (size > capacity_)
+            return false;
+        if (size <= committed_)
+            return true;
+        if (mprotect(data_ + committed_, size - committed_, PROT_READ | PROT_WRITE) != 0)
+            return false;
+        committed_ = size;
+        return true;
+    }
+
+    static BFTape*& active_tape()
+    {
+        static BFTape* tape = nullptr;
+        return tape;
+    }
+
+    static void handle_fault(int sig, siginfo_t* info, void* context)
+    {
+        BFTape* tape = active_tape();
+        uint8_t* addr = static_cast<uint8_t*>(info->si_addr);
+        if (tape && addr >= tape->data_ + tape->committed_ &&
+            addr < tape->data_ + tape->capacity_)
+        {
+            // Grow at least geometrically, so a program sweeping to the right
+            // faults only a logarithmic number of times.
+            size_t needed = static_cast<size_t>(addr - tape->data_) + 1;
+            size_t doubled = tape->committed_ * 2;
+            if (tape->commit(needed > doubled ? needed : doubled) || tape->commit(needed))
+                return;
+        }
+
+        // Not a fault we can fix: restore the previous handler and return, so the
+        // faulting instruction runs again and takes the default action.
+        if (tape && addr >= tape->base_ &&
+            addr < tape->data_ + tape->capacity_ + tape->guard_size_)
+        {
+            static const char message[] = "bf: data pointer moved out of the tape\n";
+            ssize_t ignored = write(STDERR_FILENO, message, sizeof(message) - 1);
+            (void)ignored;
+        }
+        if (tape)
+            sigaction(sig, sig == SIGBUS ? &tape->previous_bus_ : &tape->previous_segv_,
+                      nullptr);
+        else
+            signal(sig, SIG_DFL);
+    }
+
+    size_t page_size_;
+    size_t capacity_;
+    size_t guard_size_;
+    size_t committed_;
+    uint8_t* base_;
+    uint8_t* data_;
+    struct sigaction previous_segv_;
+    struct sigaction previous_bus_;
+};
+
+#endif  // BRAINFUCK_TAPE_H
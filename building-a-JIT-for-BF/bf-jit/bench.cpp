@@ -0,0 +1,521 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <linux/perf_event.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/FormatVariadic.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+static llvm::cl::opt<std::string> TestcaseDir(
+    "testcase-dir", llvm::cl::init("../testcase"), llvm::cl::value_desc("directory"),
+    llvm::cl::desc("Directory containing the .bf programs"));
+static llvm::cl::opt<std::string> GoldenDir(
+    "golden-dir", llvm::cl::value_desc("directory"),
+    llvm::cl::desc("Directory containing <name>.out (expected output) and optional "
+                   "<name>.in (stdin) files; defaults to <testcase-dir>/golden"));
+static llvm::cl::list<std::string> Engines(
+    "engine", llvm::cl::value_desc("name=command"),
+    llvm::cl::desc("Engine to benchmark; the program path is appended to the "
+                   "command. Defaults to bf-interpreter, bf-jit and bf-tiered "
+                   "next to bf-bench"));
+static llvm::cl::list<std::string> Programs(
+    "program", llvm::cl::value_desc("name"),
+    llvm::cl::desc("Only run this testcase (e.g. mandelbrot); may be repeated"));
+static llvm::cl::opt<unsigned> Repetitions(
+    "repetitions", llvm::cl::init(3),
+    llvm::cl::desc("Runs per program and engine; the fastest run is reported"));
+static llvm::cl::opt<unsigned> Timeout(
+    "timeout", llvm::cl::init(300),
+    llvm::cl::desc("CPU time limit of a single run, in seconds"));
+enum class ReportFormat
+{
+    JSON,
+    CSV,
+};
+static llvm::cl::opt<ReportFormat> Format(
+    "format", llvm::cl::init(ReportFormat::JSON),
+    llvm::cl::desc("Format of the report"),
+    llvm::cl::values(clEnumValN(ReportFormat::JSON, "json", "A JSON document"),
+                     clEnumValN(ReportFormat::CSV, "csv", "One CSV row per run")));
+static llvm::cl::opt<std::string> OutputFilename(
+    "o", llvm::cl::init("-"), llvm::cl::value_desc("filename"),
+    llvm::cl::desc("Write the report to this file instead of stdout"));
+static llvm::cl::opt<std::string> BaselineFilename(
+    "baseline", llvm::cl::value_desc("filename"),
+    llvm::cl::desc("A JSON report of an earlier run to check for regressions"));
+static llvm::cl::opt<double> MaxSlowdown(
+    "max-slowdown", llvm::cl::init(1.10),
+    llvm::cl::desc("Fail if a time exceeds the baseline by more than this factor"));
+static llvm::cl::opt<double> NoiseFloor(
+    "noise-floor-ms", llvm::cl::init(5.0),
+    llvm::cl::desc("Ignore slowdowns smaller than this many milliseconds"));
+
+/// A way of running a BF program: a command line the program path is appended to.
+struct BenchEngine
+{
+    std::string name;
+    std::vector<std::string> command;
+};
+
+/// The measurements of a single run of one program on one engine. Times are in
+/// milliseconds; negative values mean "not available".
+struct BenchResult
+{
+    std::string program;
+    std::string engine;
+    std::string status;
+    int exit_code = 0;
+    double wall_ms = -1;
+    double compile_ms = -1;
+    double run_ms = -1;
+    int64_t instructions = -1;
+    long peak_rss_kb = -1;
+};
+
+/// Count the user-space instructions retired by `pid` and the threads it creates
+/// from now on. Returns -1 where hardware counters are unavailable.
+static int open_instruction_counter(pid_t pid)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return static_cast<int>(syscall(__NR_perf_event_open, &attr, pid, -1, -1, 0));
+}
+
+/// Return the peak resident set size of a live process, in KiB, or -1.
+static long read_peak_rss(pid_t pid)
+{
+    std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+    std::string line;
+    while (std::getline(status, line))
+    {
+        if (line.compare(0, 6, "VmHWM:") == 0)
+            return atol(line.c_str() + 6);
+    }
+    return -1;
+}
+
+static std::string read_file(const std::string& path)
+{
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer =
+        llvm::MemoryBuffer::getFile(path);
+    if (!buffer)
+        return std::string();
+    return (*buffer)->getBuffer().str();
+}
+
+/// Pick the compile and execute times out of the -time-phases report of bf-jit.
+static void parse_phase_times(llvm::StringRef err, BenchResult& result)
+{
+    size_t header = err.find("phase times");
+    if (header == llvm::StringRef::npos)
+        return;
+    llvm::SmallVector<llvm::StringRef, 8> lines;
+    err.substr(header).split(lines, '\n', -1, false);
+    double compile_ms = 0;
+    for (llvm::StringRef line : lines)
+    {
+        std::pair<llvm::StringRef, llvm::StringRef> fields = line.trim().split(' ');
+        double ms;
+        if (fields.second.trim().getAsDouble(ms))
+            continue;
+        if (fields.first == "emit" || fields.first == "optimize" ||
+            fields.first == "codegen" || fields.first == "load")
+            compile_ms += ms;
+        else if (fields.first == "execute")
+            result.run_ms = ms;
+    }
+    result.compile_ms = compile_ms;
+}
+
+/// Run `engine` on `program` once with stdin redirected from `input` (or
+/// /dev/null) and stdout compared against `expected`.
+static BenchResult run_once(const BenchEngine& engine, const std::string& name,
+                            const std::string& program, const std::string& input,
+                            const std::string& expected)
+{
+    BenchResult result;
+    result.program = name;
+    result.engine = engine.name;
+
+    int out_fd, err_fd;
+    llvm::SmallString<128> out_path, err_path;
+    if (llvm::sys::fs::createTemporaryFile("bf-bench", "out", out_fd, out_path) ||
+        llvm::sys::fs::createTemporaryFile("bf-bench", "err", err_fd, err_path))
+    {
+        result.status = "failed";
+        return result;
+    }
+    int in_fd = open(input.empty() ? "/dev/null" : input.c_str(), O_RDONLY);
+
+    std::vector<const char*> argv;
+    for (const std::string& arg : engine.command)
+        argv.push_back(arg.c_str());
+    argv.push_back(program.c_str());
+    argv.push_back(nullptr);
+
+    // The engine runs under ptrace, so that it stops right after exec, where the
+    // instruction counter is attached, and right before it exits, where its peak
+    // RSS is read. ru_maxrss would also count the pages of bf-bench itself that
+    // the child owned between fork and exec.
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        dup2(in_fd, STDIN_FILENO);
+        dup2(out_fd, STDOUT_FILENO);
+        dup2(err_fd, STDERR_FILENO);
+        struct rlimit limit;
+        limit.rlim_cur = limit.rlim_max = Timeout;
+        setrlimit(RLIMIT_CPU, &limit);
+        ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+        execvp(argv[0], const_cast<char* const*>(argv.data()));
+        _exit(127);
+    }
+
+    int counter = -1;
+    int status = 0;
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    bool exec_stop = true;
+    while (pid > 0 && wait4(pid, &status, 0, &usage) == pid && WIFSTOPPED(status))
+    {
+        int signal = WSTOPSIG(status);
+        if (exec_stop && signal == SIGTRAP)
+        {
+            exec_stop = false;
+            ptrace(PTRACE_SETOPTIONS, pid, nullptr,
+                   reinterpret_cast<void*>(PTRACE_O_TRACEEXIT | PTRACE_O_EXITKILL));
+            counter = open_instruction_counter(pid);
+            signal = 0;
+        }
+        else if (status >> 8 == (SIGTRAP | (PTRACE_EVENT_EXIT << 8)))
+        {
+            result.peak_rss_kb = read_peak_rss(pid);
+            signal = 0;
+        }
+        // Pass every other signal on, e.g. the faults that grow the bf-jit tape.
+        ptrace(PTRACE_CONT, pid, nullptr, reinterpret_cast<void*>(signal));
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    close(in_fd);
+    close(out_fd);
+    close(err_fd);
+
+    if (counter >= 0)
+    {
+        uint64_t count;
+        if (read(counter, &count, sizeof(count)) == sizeof(count))
+            result.instructions = static_cast<int64_t>(count);
+        close(counter);
+    }
+    if (result.peak_rss_kb < 0)
+        result.peak_rss_kb = usage.ru_maxrss;
+    result.wall_ms = std::chrono::duration<double, std::milli>(end - start).count();
+    result.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+    std::string out = read_file(out_path.str().str());
+    std::string err = read_file(err_path.str().str());
+    llvm::sys::fs::remove(out_path);
+    llvm::sys::fs::remove(err_path);
+
+    parse_phase_times(err, result);
+    if (result.run_ms < 0)
+        result.run_ms = result.wall_ms;
+    if (pid <= 0 || result.exit_code != 0)
+        result.status = "failed";
+    else if (out != expected)
+        result.status = "mismatch";
+    else
+        result.status = "ok";
+    return result;
+}
+
+/// Run `engine` on `program` Repetitions times and keep the best of each metric.
+static BenchResult run(const BenchEngine& engine, const std::string& name,
+                       const std::string& program, const std::string& input,
+                       const std::string& expected)
+{
+    BenchResult best = run_once(engine, name, program, input, expected);
+    for (unsigned i = 1; i < Repetitions && best.status == "ok"; ++i)
+    {
+        BenchResult result = run_once(engine, name, program, input, expected);
+        if (result.status != "ok")
+            return result;
+        best.wall_ms = std::min(best.wall_ms, result.wall_ms);
+        best.compile_ms = std::min(best.compile_ms, result.compile_ms);
+        best.run_ms = std::min(best.run_ms, result.run_ms);
+        if (result.instructions >= 0)
+            best.instructions = std::min(best.instructions, result.instructions);
+        best.peak_rss_kb = std::min(best.peak_rss_kb, result.peak_rss_kb);
+    }
+    return best;
+}
+
+static std::vector<BenchEngine> get_engines(const char* argv0)
+{
+    std::vector<BenchEngine> engines;
+    for (const std::string& spec : Engines)
+    {
+        std::pair<llvm::StringRef, llvm::StringRef> parts =
+            llvm::StringRef(spec).split('=');
+        llvm::SmallVector<llvm::StringRef, 4> words;
+        parts.second.split(words, ' ', -1, false);
+        BenchEngine engine;
+        engine.name = parts.first.str();
+        for (llvm::StringRef word : words)
+            engine.command.push_back(word.str());
+        if (engine.name.empty() || engine.command.empty())
+        {
+            llvm::errs() << "bf-bench: expected -engine=<name>=<command>, got '" << spec
+                         << "'\n";
+            exit(2);
+        }
+        engines.push_back(engine);
+    }
+    if (!engines.empty())
+        return engines;
+
+    // By default, benchmark the tiers built alongside bf-bench.
+    std::string self = llvm::sys::fs::getMainExecutable(
+        argv0, reinterpret_cast<void*>(&get_engines));
+    llvm::StringRef dir = llvm::sys::path::parent_path(self);
+    const char* const defaults[][2] = {
+        {"interpreter", "bf-interpreter"}, {"jit", "bf-jit"}, {"tiered", "bf-tiered"}};
+    for (const auto& tier : defaults)
+    {
+        llvm::SmallString<128> path(dir);
+        llvm::sys::path::append(path, tier[1]);
+        if (!llvm::sys::fs::can_execute(path))
+            continue;
+        BenchEngine engine;
+        engine.name = tier[0];
+        engine.command.push_back(path.str().str());
+        if (engine.name == "jit")
+            engine.command.push_back("-time-phases");
+        engines.push_back(engine);
+    }
+    return engines;
+}
+
+/// The programs that have a golden output, sorted by name.
+static std::vector<std::string> get_programs(llvm::StringRef golden_dir)
+{
+    std::vector<std::string> names;
+    std::error_code ec;
+    for (llvm::sys::fs::directory_iterator it(TestcaseDir, ec), end; it != end && !ec;
+         it.increment(ec))
+    {
+        llvm::StringRef path = it->path();
+        if (llvm::sys::path::extension(path) != ".bf")
+            continue;
+        llvm::StringRef name = llvm::sys::path::stem(path);
+        if (!Programs.empty() &&
+            std::find(Programs.begin(), Programs.end(), name) == Programs.end())
+            continue;
+        llvm::SmallString<128> golden(golden_dir);
+        llvm::sys::path::append(golden, name + ".out");
+        if (llvm::sys::fs::exists(golden))
+            names.push_back(name.str());
+    }
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+static llvm::json::Value to_json(const BenchResult& result)
+{
+    auto optional = [](double value) -> llvm::json::Value {
+        if (value < 0)
+            return nullptr;
+        return value;
+    };
+    return llvm::json::Object{
+        {"program", result.program},
+        {"engine", result.engine},
+        {"status", result.status},
+        {"exit_code", result.exit_code},
+        {"wall_ms", optional(result.wall_ms)},
+        {"compile_ms", optional(result.compile_ms)},
+        {"run_ms", optional(result.run_ms)},
+        {"instructions", result.instructions < 0
+                             ? llvm::json::Value(nullptr)
+                             : llvm::json::Value(result.instructions)},
+        {"peak_rss_kb", optional(static_cast<double>(result.peak_rss_kb))},
+    };
+}
+
+static void print_csv(llvm::raw_ostream& os, const std::vector<BenchResult>& results)
+{
+    auto optional = [](double value) -> std::string {
+        return value < 0 ? std::string() : llvm::formatv("{0:f3}", value).str();
+    };
+    os << "program,engine,status,exit_code,wall_ms,compile_ms,run_ms,instructions,"
+          "peak_rss_kb\n";
+    for (const BenchResult& result : results)
+    {
+        os << result.program << ',' << result.engine << ',' << result.status << ','
+           << result.exit_code << ',' << optional(result.wall_ms) << ','
+           << optional(result.compile_ms) << ',' << optional(result.run_ms) << ',';
+        if (result.instructions >= 0)
+            os << result.instructions;
+        os << ',';
+        if (result.peak_rss_kb >= 0)
+            os << result.peak_rss_kb;
+        os << '\n';
+    }
+}
+
+/// Compare the times against an earlier JSON report. Returns the number of
+/// regressions, each of which is reported on stderr.
+static unsigned check_baseline(const std::vector<BenchResult>& results)
+{
+    llvm::Expected<llvm::json::Value> baseline =
+        llvm::json::parse(read_file(BaselineFilename));
+    const llvm::json::Array* entries = nullptr;
+    if (baseline && baseline->getAsObject())
+        entries = baseline->getAsObject()->getArray("benchmarks");
+    if (!entries)
+    {
+        if (!baseline)
+            llvm::consumeError(baseline.takeError());
+        llvm::errs() << "bf-bench: cannot read baseline '" << BaselineFilename << "'\n";
+        return 1;
+    }
+
+    std::map<std::pair<std::string, std::string>, const llvm::json::Object*> index;
+    for (const llvm::json::Value& entry : *entries)
+    {
+        const llvm::json::Object* object = entry.getAsObject();
+        if (!object || !object->getString("program") || !object->getString("engine"))
+            continue;
+        index[std::make_pair(object->getString("program")->str(),
+                             object->getString("engine")->str())] = object;
+    }
+
+    unsigned regressions = 0;
+    for (const BenchResult& result : results)
+    {
+        auto it = index.find(std::make_pair(result.program, result.engine));
+        if (it == index.end() || result.status != "ok")
+            continue;
+        const std::pair<const char*, double> metrics[] = {
+            {"compile_ms", result.compile_ms}, {"run_ms", result.run_ms}};
+        for (const auto& metric : metrics)
+        {
+            llvm::Optional<double> before = it->second->getNumber(metric.first);
+            if (!before || metric.second < 0)
+                continue;
+            if (metric.second > *before * MaxSlowdown &&
+                metric.second - *before > NoiseFloor)
+            {
+                llvm::errs() << llvm::formatv(
+                    "bf-bench: {0} on {1}: {2} regressed from {3:f3} to {4:f3}\n",
+                    result.program, result.engine, metric.first, *before,
+                    metric.second);
+                ++regressions;
+            }
+        }
+    }
+    return regressions;
+}
+
+int main(int argc, const char** argv)
+{
+    llvm::cl::ParseCommandLineOptions(
+        argc, argv,
+        "Run the brainfuck testcases on every engine, check their output and report "
+        "timings.\n");
+
+    std::string golden_dir = GoldenDir;
+    if (golden_dir.empty())
+    {
+        llvm::SmallString<128> path(TestcaseDir);
+        llvm::sys::path::append(path, "golden");
+        golden_dir = path.str().str();
+    }
+
+    std::vector<BenchEngine> engines = get_engines(argv[0]);
+    std::vector<std::string> programs = get_programs(golden_dir);
+    if (engines.empty() || programs.empty())
+    {
+        llvm::errs() << "bf-bench: no engines or no programs with golden output\n";
+        return 2;
+    }
+
+    std::vector<BenchResult> results;
+    unsigned failures = 0;
+    for (const std::string& name : programs)
+    {
+        llvm::SmallString<128> program(TestcaseDir), input(golden_dir),
+            expected(golden_dir);
+        llvm::sys::path::append(program, name + ".bf");
+        llvm::sys::path::append(input, name + ".in");
+        llvm::sys::path::append(expected, name + ".out");
+        std::string expected_output = read_file(expected.str().str());
+        std::string input_path = llvm::sys::fs::exists(input) ? input.str().str() : "";
+
+        for (const BenchEngine& engine : engines)
+        {
+            results.push_back(
+                run(engine, name, program.str().str(), input_path, expected_output));
+            if (results.back().status != "ok")
+            {
+                llvm::errs() << "bf-bench: " << name << " on " << engine.name << ": "
+                             << results.back().status << " (exit code "
+                             << results.back().exit_code << ")\n";
+                ++failures;
+            }
+        }
+    }
+
+    std::error_code ec;
+    llvm::raw_fd_ostream os(OutputFilename, ec, llvm::sys::fs::F_Text);
+    if (ec)
+    {
+        llvm::errs() << "bf-bench: " << ec.message() << "\n";
+        return 2;
+    }
+    if (Format == ReportFormat::CSV)
+    {
+        print_csv(os, results);
+    }
+    else
+    {
+        llvm::json::Array benchmarks;
+        for (const BenchResult& result : results)
+            benchmarks.push_back(to_json(result));
+        os << llvm::formatv("{0:2}",
+                            llvm::json::Value(llvm::json::Object{
+                                {"benchmarks", std::move(benchmarks)}}))
+           << "\n";
+    }
+
+    if (!BaselineFilename.empty())
+        failures += check_baseline(results);
+    return failures == 0 ? 0 : 1;
+}
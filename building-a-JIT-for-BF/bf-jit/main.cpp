@@ -1,240 +1,779 @@
+#include "BFCodegen.h"
 #include "BFJit.h"
+#include "BFObjectCache.h"
+#include "BFProfile.h"
+#include "BFProgram.h"
+#include "BFRuntime.h"
+#include "BFTape.h"
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <fcntl.h>
 #include <fstream>
 #include <iostream>
-#include <llvm/IR/BasicBlock.h>
+#include <limits>
+#include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/ExecutionEngine/Orc/CompileUtils.h>
 #include <llvm/IR/Function.h>
-#include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Module.h>
-#include <llvm/IR/Type.h>
 #include <llvm/IR/Verifier.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/Program.h>
 #include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
 #include <llvm/Target/TargetMachine.h>
-#include <llvm/Transforms/IPO/PassManagerBuilder.h>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
 
-constexpr int MEMORY_SIZE = 30000;
-const char* const JIT_FUNC_NAME = "__llvmjit";
+static llvm::cl::opt<std::string> InputFilename(llvm::cl::Positional,
+                                                llvm::cl::desc("<filename>.bf"));
+static llvm::cl::opt<std::string> BatchManifest(
+    "batch", llvm::cl::value_desc("manifest"),
+    llvm::cl::desc("Run every program listed in the manifest ('-' for stdin) on one "
+                   "JIT instead of a single program"));
+static llvm::cl::opt<unsigned> Jobs(
+    "jobs", llvm::cl::init(0),
+    llvm::cl::desc("Number of threads compiling the programs of a batch; 0 uses "
+                   "every core"));
+static llvm::cl::opt<bool> Lazy(
+    "lazy", llvm::cl::desc("Only compile the outermost loops that are reached, when "
+                           "they are first reached"));
+static llvm::cl::opt<bool> DisableLoopIdioms(
+    "disable-loop-idioms",
+    llvm::cl::desc("Emit clear, multiply and scan loops as plain loops"));
+static llvm::cl::opt<unsigned> MaxTapeSize(
+    "max-tape-size", llvm::cl::init(1u << 30),
+    llvm::cl::desc("Maximum number of cells the tape may grow to"));
+static llvm::cl::opt<unsigned> CellBits(
+    "cell-bits", llvm::cl::init(8),
+    llvm::cl::desc("Width of the cells in bits: 8, 16 or 32"));
+static llvm::cl::opt<BFEofMode> EofMode(
+    "eof", llvm::cl::desc("What ',' stores when the input is exhausted"),
+    llvm::cl::init(BFEofMode::MinusOne),
+    llvm::cl::values(clEnumValN(BFEofMode::Zero, "zero", "0"),
+                     clEnumValN(BFEofMode::MinusOne, "minus-one",
+                                "-1, i.e. all bits set (default)"),
+                     clEnumValN(BFEofMode::Unchanged, "unchanged",
+                                "Leave the cell unchanged")));
+static llvm::cl::opt<BFPipeline> Pipeline(
+    "pipeline", llvm::cl::desc("Optimization pipeline run over the emitted IR"),
+    llvm::cl::init(BFPipeline::O3),
+    llvm::cl::values(clEnumValN(BFPipeline::O0, "O0", "No optimization"),
+                     clEnumValN(BFPipeline::O1, "O1", "The standard -O1 pipeline"),
+                     clEnumValN(BFPipeline::O2, "O2", "The standard -O2 pipeline"),
+                     clEnumValN(BFPipeline::O3, "O3", "The standard -O3 pipeline"),
+                     clEnumValN(BFPipeline::Minimal, "minimal",
+                                "A few cheap passes tuned for BF code")));
+static llvm::cl::opt<bool> TimePhases(
+    "time-phases",
+    llvm::cl::desc("Report the wall time of each phase of the run to stderr"));
+static llvm::cl::opt<std::string> ProfileOutput(
+    "profile", llvm::cl::value_desc("file"),
+    llvm::cl::desc("Count the ops each loop executes, report the hottest loops to "
+                   "stderr and write a flame graph (collapsed stacks) to the file"));
+static llvm::cl::opt<std::string> EmitObj(
+    "emit-obj", llvm::cl::value_desc("file"),
+    llvm::cl::desc("Compile the program ahead of time to a relocatable object with a "
+                   "main function instead of running it"));
+static llvm::cl::opt<std::string> EmitExe(
+    "emit-exe", llvm::cl::value_desc("file"),
+    llvm::cl::desc("Compile the program ahead of time and link it into an executable "
+                   "with the system C compiler driver (cc) instead of running it"));
+static llvm::cl::opt<std::string> ObjectCacheDir(
+    "object-cache-dir", llvm::cl::value_desc("directory"),
+    llvm::cl::desc("Reuse compiled programs from, and store them to, this directory"));
 
-using BracketBlocks = std::pair<llvm::BasicBlock*, llvm::BasicBlock*>;
-
-struct BFProgram
+/// Wall time spent in each phase of a run, reported with -time-phases.
+class PhaseTimes
 {
-    std::string instructions;
+public:
+    PhaseTimes() : start_(std::chrono::steady_clock::now()) {}
+
+    /// Start timing the next phase now, e.g. after waiting for another thread.
+    void restart()
+    {
+        start_ = std::chrono::steady_clock::now();
+    }
+
+    /// Attribute the time since the previous call (or construction) to `phase`.
+    void record(const char* phase)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        phases_.push_back(std::make_pair(
+            phase, std::chrono::duration<double, std::milli>(now - start_).count()));
+        start_ = now;
+    }
+
+    void print(llvm::raw_ostream& os) const
+    {
+        const char* total_name = "total";
+        double total = 0;
+        os << "===-- bf-jit phase times (wall, ms) --===\n";
+        for (const auto& phase : phases_)
+        {
+            os << llvm::format("%-10s %12.3f\n", phase.first, phase.second);
+            total += phase.second;
+        }
+        os << llvm::format("%-10s %12.3f\n", total_name, total);
+    }
+
+private:
+    std::chrono::steady_clock::time_point start_;
+    std::vector<std::pair<const char*, double>> phases_;
 };
 
-BFProgram parse_from_stream(std::istream& stream)
+/// Options that change the emitted code and are therefore part of the cache key.
+static std::string codegen_options()
 {
-    BFProgram program;
+    std::string options;
+    if (DisableLoopIdioms)
+        options += " -disable-loop-idioms";
+    if (Lazy)
+        options += " -lazy";
+    if (!ProfileOutput.empty())
+        options += " -profile";
+    if (CellBits != 8)
+        options += " -cell-bits=" + std::to_string(CellBits);
+    if (EofMode != BFEofMode::MinusOne)
+        options += EofMode == BFEofMode::Zero ? " -eof=zero" : " -eof=unchanged";
+    return options;
+}
+
+/// The cells selected on the command line.
+static BFCellConfig cell_config()
+{
+    return BFCellConfig(CellBits, EofMode);
+}
+
+/// The size of the tape in bytes. Computed in 64 bits, because -max-tape-size
+/// cells of 32 bits overflow an unsigned.
+static uint64_t tape_bytes()
+{
+    return static_cast<uint64_t>(MaxTapeSize) * cell_config().cell_bytes();
+}
+
+/// Parse the program `name` from `stream` and apply the op-level rewrites selected
+/// on the command line. Reports malformed programs and returns false.
+static bool load_program(std::istream& stream, const std::string& name,
+                         BFProgram& program)
+{
+    BFParseError error;
+    if (!parse_from_stream(stream, program, error))
+    {
+        llvm::errs() << error.describe(name) << "\n";
+        return false;
+    }
+    if (!DisableLoopIdioms)
+        program.ops = recognize_loop_idioms(program.ops, CellBits);
+    return true;
+}
+
+/// The object cache key of `p` compiled by `tm`.
+static std::string cache_key(llvm::TargetMachine& tm, const BFProgram& p)
+{
+    return BFObjectCache::computeKey(
+        p.instructions, tm.getTargetTriple().str() + "/" + tm.getTargetCPU().str(),
+        pipeline_name(Pipeline), codegen_options());
+}
+
+/// Emit `p` into a new module named `module_name` and optimize it.
+static std::unique_ptr<llvm::Module> build_module(const BFProgram& p,
+                                                  const std::string& module_name,
+                                                  llvm::LLVMContext& context,
+                                                  const llvm::DataLayout& data_layout,
+                                                  PhaseTimes& times)
+{
+    std::unique_ptr<llvm::Module> module(new llvm::Module(module_name, context));
+
+    // Add the output buffer and the declarations of the runtime functions used
+    // for I/O in the JITed code.
+    BFRuntimeDecls runtime = declare_runtime(module.get());
+    if (!ProfileOutput.empty())
+        declare_profile_counts(module.get(), runtime, p.ops.size());
+
+    // Compile the BF program to LLVM IR.
+    llvm::Function* jit_fn =
+        emit_jit_function(p, module.get(), runtime, cell_config(), Lazy);
+
+    llvm::verifyFunction(*jit_fn);
+    times.record("emit");
+
+    // Optimize the emitted LLVM IR.
+    optimize_module(module.get(), Pipeline);
+    times.record("optimize");
+
+    module->setDataLayout(data_layout);
+    return module;
+}
+
+/// Emit the loop of `p` starting at `begin` as the function `name` into a new
+/// module named `module_name`, and optimize it.
+static std::unique_ptr<llvm::Module>
+build_loop_module(const BFProgram& p, size_t begin, const std::string& name,
+                  const std::string& module_name, llvm::LLVMContext& context,
+                  const llvm::DataLayout& data_layout)
+{
+    std::unique_ptr<llvm::Module> module(new llvm::Module(module_name, context));
+    BFRuntimeDecls runtime = declare_runtime(module.get());
+    if (!ProfileOutput.empty())
+        declare_profile_counts(module.get(), runtime, p.ops.size());
+    llvm::Function* loop_fn =
+        emit_loop_function(p, begin, module.get(), runtime, cell_config());
+    loop_fn->setName(name);
+    llvm::verifyFunction(*loop_fn);
+    optimize_module(module.get(), Pipeline);
+    module->setDataLayout(data_layout);
+    return module;
+}
+
+/// Define a lazily compiled function for every outermost loop of `p`, for the
+/// main function emitted with -lazy to call. A loop's module is only emitted,
+/// optimized and compiled when the loop is first reached, and goes through the
+/// object cache like any other module.
+static void add_lazy_loops(BrainfuckJIT& jit, llvm::LLVMContext& context,
+                           const BFProgram& p, const std::string& module_name)
+{
+    for (size_t pc = 0; pc < p.ops.size(); ++pc)
+    {
+        if (p.ops[pc].kind != BFOpKind::LoopBegin)
+            continue;
+        size_t begin = pc;
+        std::string loop_module_name = module_name + loop_function_name(begin);
+        llvm::DataLayout data_layout = jit.getTargetMachine().createDataLayout();
+        jit.addLazyFunction(
+            loop_function_name(begin),
+            [&context, &p, begin, loop_module_name,
+             data_layout](const std::string& impl_name) -> std::unique_ptr<llvm::Module> {
+                return build_loop_module(p, begin, impl_name, loop_module_name, context,
+                                         data_layout);
+            });
+        pc = p.ops[pc].match;
+    }
+}
+
+/// The function emit_jit_function creates.
+using JitFuncType = void (*)(uint8_t*, uint64_t);
 
-    for (std::string line; std::getline(stream, line);)
+/// Look up the function of the program in module `key`. The JIT compiles and links
+/// a module on the first lookup of one of its symbols, so this does the work that
+/// addModule and addObject defer.
+static JitFuncType lookup_program(BrainfuckJIT& jit, llvm::orc::VModuleKey key)
+{
+    JitFuncType jit_func_ptr =
+        reinterpret_cast<JitFuncType>(jit.getSymbolAddressIn(key, JIT_FUNC_NAME));
+    assert(jit_func_ptr && "Failed to codegen function");
+    return jit_func_ptr;
+}
+
+/// Compile `p` into `jit`, or load it from `cache`, and return its function. `p`
+/// must outlive the module with -lazy.
+static JitFuncType compile_program(BrainfuckJIT& jit, BFObjectCache* cache,
+                                   llvm::LLVMContext& context, const BFProgram& p,
+                                   PhaseTimes& times)
+{
+    // On a cache hit, load the object straight into the JIT and skip the LLVM
+    // optimizer and code generator entirely. The key doubles as the module name,
+    // so that SimpleCompiler stores the object under the same key on a miss.
+    std::string module_name = "bf_module";
+    if (cache)
+        module_name = cache_key(jit.getTargetMachine(), p);
+    if (Lazy)
+        add_lazy_loops(jit, context, p, module_name);
+    if (cache)
     {
-        for (auto c : line)
+        std::unique_ptr<llvm::MemoryBuffer> cached_object =
+            cache->getCachedObject(module_name);
+        if (cached_object)
         {
-            if (c == '>' || c == '<' || c == '+' || c == '-' || c == '.' || c == ',' ||
-                c == '[' || c == ']')
-            {
-                program.instructions.push_back(c);
-            }
+            JitFuncType jit_func_ptr =
+                lookup_program(jit, jit.addObject(std::move(cached_object)));
+            times.record("load");
+            return jit_func_ptr;
         }
     }
-    return program;
+
+    // JIT the optimized LLVM IR to native code.
+    llvm::orc::VModuleKey key =
+        jit.addModule(build_module(p, module_name, context,
+                                   jit.getTargetMachine().createDataLayout(), times));
+    JitFuncType jit_func_ptr = lookup_program(jit, key);
+    times.record("codegen");
+    return jit_func_ptr;
 }
 
-llvm::Function* emit_jit_function(const BFProgram& program, llvm::Module* module,
-                                  llvm::Function* putchar_fn, llvm::Function* getchar_fn)
+/// Execute the compiled program `jit_func_ptr` on a fresh guarded tape. Memory
+/// beyond the first MEMORY_SIZE cells is committed on demand. Returns false if the
+/// tape cannot be reserved.
+static bool run_program(JitFuncType jit_func_ptr, PhaseTimes& times)
 {
-    llvm::LLVMContext& context = module->getContext();
+    size_t cell_bytes = cell_config().cell_bytes();
+    BFTape tape(static_cast<size_t>(tape_bytes()), MEMORY_SIZE * cell_bytes);
+    if (!tape.valid())
+    {
+        llvm::errs() << "bf-jit: cannot reserve the tape\n";
+        return false;
+    }
+    jit_func_ptr(tape.data(), tape.capacity());
+    fflush(runtime_io().output);
+    times.record("execute");
+    return true;
+}
+
+/// Emit `p` together with a runtime and a main function into a module for the
+/// target of `tm`, see emit_standalone_runtime, and optimize it with the runtime
+/// inlined.
+static std::unique_ptr<llvm::Module> build_standalone_module(llvm::TargetMachine& tm,
+                                                             const BFProgram& p,
+                                                             llvm::LLVMContext& context,
+                                                             PhaseTimes& times)
+{
+    std::unique_ptr<llvm::Module> module(new llvm::Module("bf_module", context));
+    BFRuntimeDecls runtime = declare_runtime(module.get());
+    emit_jit_function(p, module.get(), runtime, cell_config());
+    emit_standalone_runtime(module.get(), runtime, tape_bytes());
+    llvm::verifyModule(*module);
+    times.record("emit");
+
+    optimize_module(module.get(), Pipeline, true);
+    times.record("optimize");
+
+    module->setTargetTriple(tm.getTargetTriple().str());
+    module->setDataLayout(tm.createDataLayout());
+    return module;
+}
 
-    llvm::Type* int32_type = llvm::Type::getInt32Ty(context);
-    llvm::Type* int8_type = llvm::Type::getInt8Ty(context);
-    llvm::Type* void_type = llvm::Type::getVoidTy(context);
+/// Generate code for `module` with `tm` and write it to `path` as an object file.
+static bool write_object(llvm::TargetMachine& tm, llvm::Module& module,
+                         const std::string& path)
+{
+    std::error_code error;
+    llvm::raw_fd_ostream out(path, error, llvm::sys::fs::F_None);
+    if (error)
+    {
+        llvm::errs() << "bf-jit: cannot open '" << path << "': " << error.message()
+                     << "\n";
+        return false;
+    }
+    llvm::legacy::PassManager pm;
+    if (tm.addPassesToEmitFile(pm, out, nullptr, llvm::TargetMachine::CGFT_ObjectFile))
+    {
+        llvm::errs() << "bf-jit: the target cannot emit object files\n";
+        return false;
+    }
+    pm.run(module);
+    return true;
+}
 
-    llvm::FunctionType* jit_fn_type = llvm::FunctionType::get(void_type, {}, false);
-    llvm::Function* jit_fn = llvm::Function::Create(
-        jit_fn_type, llvm::Function::ExternalLinkage, JIT_FUNC_NAME, module);
+/// Link the object at `object_path` into the executable `exe_path` with cc, which
+/// also brings in libc. The JIT's TargetMachine generates non-PIC code, hence
+/// -no-pie.
+static bool link_executable(const std::string& object_path, const std::string& exe_path)
+{
+    llvm::ErrorOr<std::string> linker = llvm::sys::findProgramByName("cc");
+    if (!linker)
+    {
+        llvm::errs() << "bf-jit: no system linker (cc) found; link '" << object_path
+                     << "' against libc to get an executable\n";
+        return false;
+    }
+    llvm::StringRef args[] = { *linker, "-no-pie", object_path, "-o", exe_path };
+    std::string message;
+    int status = llvm::sys::ExecuteAndWait(*linker, args, llvm::None, {}, 0, 0, &message);
+    if (status != 0)
+    {
+        llvm::errs() << "bf-jit: linking '" << exe_path << "' failed";
+        if (!message.empty())
+            llvm::errs() << ": " << message;
+        llvm::errs() << "\n";
+        return false;
+    }
+    return true;
+}
 
-    llvm::BasicBlock* entry_bb = llvm::BasicBlock::Create(context, "entry", jit_fn);
-    llvm::IRBuilder<> builder(entry_bb);
+/// Compile `p` ahead of time for -emit-obj and/or -emit-exe. With -emit-exe alone,
+/// the object is written next to the executable and removed once it is linked.
+static bool emit_standalone(llvm::TargetMachine& tm, const BFProgram& p,
+                            PhaseTimes& times)
+{
+    llvm::LLVMContext context;
+    std::unique_ptr<llvm::Module> module = build_standalone_module(tm, p, context, times);
+    std::string object_path = !EmitObj.empty() ? EmitObj : EmitExe + ".o";
+    if (!write_object(tm, *module, object_path))
+        return false;
+    times.record("codegen");
+    if (EmitExe.empty())
+        return true;
 
-    // Create stack allocations for the memory and the data pointer. The memory
-    // is memset to zeros. The data pointer is used as an offset into the memory
-    // array; it is initialized to 0.
-    llvm::AllocaInst* memory =
-        builder.CreateAlloca(int8_type, builder.getInt32(MEMORY_SIZE), "memory");
-    builder.CreateMemSet(memory, builder.getInt8(0), MEMORY_SIZE, 1);
-    llvm::AllocaInst* dataptr_addr =
-        builder.CreateAlloca(int32_type, nullptr, "dataptr_addr");
-    builder.CreateStore(builder.getInt32(0), dataptr_addr);
+    bool linked = link_executable(object_path, EmitExe);
+    times.record("link");
+    if (linked && EmitObj.empty())
+        llvm::sys::fs::remove(object_path);
+    return linked;
+}
 
-    std::stack<BracketBlocks> open_bracket_stack;
+/// A job of a batch: a program and the streams it runs with.
+struct BatchJob
+{
+    std::string line;
+    std::unique_ptr<BFProgram> program;
+    int input_fd;
+    FILE* output;
+    PhaseTimes times;
+    std::unique_ptr<llvm::MemoryBuffer> object;
+};
 
-    for (size_t pc = 0; pc < program.instructions.size(); ++pc)
+/// Compiles the programs of a batch to object files on a pool of worker threads.
+/// Each worker owns an LLVMContext and a TargetMachine, so programs are emitted,
+/// optimized and code generated in parallel. The objects are handed back in the
+/// order the jobs were submitted and linked into the shared JIT by the caller.
+class ParallelCompiler
+{
+public:
+    ParallelCompiler(unsigned workers, BFObjectCache* cache)
+        : cache_(cache), stop_(false)
     {
-        char instruction = program.instructions[pc];
-        switch (instruction)
-        {
-        case '>':
+        // TargetMachines are not thread-safe, so every worker gets its own.
+        for (unsigned i = 0; i < workers; ++i)
         {
-            llvm::Value* dataptr = builder.CreateLoad(dataptr_addr, "dataptr");
-            llvm::Value* inc_dataptr =
-                builder.CreateAdd(dataptr, builder.getInt32(1), "inc_dataptr");
-            builder.CreateStore(inc_dataptr, dataptr_addr);
-            break;
+            std::unique_ptr<llvm::TargetMachine> tm(llvm::EngineBuilder().selectTarget());
+            tm->setOptLevel(codegen_opt_level(Pipeline));
+            target_machines_.push_back(std::move(tm));
         }
-        case '<':
+        for (unsigned i = 0; i < workers; ++i)
         {
-            llvm::Value* dataptr = builder.CreateLoad(dataptr_addr, "dataptr");
-            llvm::Value* dec_dataptr =
-                builder.CreateSub(dataptr, builder.getInt32(1), "dec_dataptr");
-            builder.CreateStore(dec_dataptr, dataptr_addr);
-            break;
+            threads_.push_back(
+                std::thread(&ParallelCompiler::worker, this, target_machines_[i].get()));
         }
-        case '+':
+    }
+
+    /// Waits for the jobs being compiled; jobs that are still queued are dropped.
+    ~ParallelCompiler()
+    {
         {
-            llvm::Value* dataptr = builder.CreateLoad(dataptr_addr, "dataptr");
-            llvm::Value* element_addr =
-                builder.CreateInBoundsGEP(memory, { dataptr }, "element_addr");
-            llvm::Value* element = builder.CreateLoad(element_addr, "element");
-            llvm::Value* inc_element =
-                builder.CreateAdd(element, builder.getInt8(1), "inc_element");
-            builder.CreateStore(inc_element, element_addr);
-            break;
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+            queue_.clear();
         }
-        case '-':
+        queued_cv_.notify_all();
+        for (std::thread& thread : threads_)
+            thread.join();
+    }
+
+    /// Queue a job for compilation. The job must stay alive until it is returned
+    /// by take().
+    void submit(BatchJob* job)
+    {
         {
-            llvm::Value* dataptr = builder.CreateLoad(dataptr_addr, "dataptr");
-            llvm::Value* element_addr =
-                builder.CreateInBoundsGEP(memory, { dataptr }, "element_addr");
-            llvm::Value* element = builder.CreateLoad(element_addr, "element");
-            llvm::Value* dec_element =
-                builder.CreateSub(element, builder.getInt8(1), "sub_element");
-            builder.CreateStore(dec_element, element_addr);
-            break;
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.push_back(job);
+            submitted_.push_back(job);
         }
-        case '.':
+        queued_cv_.notify_one();
+    }
+
+    /// Wait until the oldest submitted job has been compiled and return it.
+    BatchJob* take()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        assert(!submitted_.empty() && "no job to take");
+        BatchJob* job = submitted_.front();
+        compiled_cv_.wait(lock, [this, job] { return compiled_.count(job) != 0; });
+        compiled_.erase(job);
+        submitted_.pop_front();
+        return job;
+    }
+
+private:
+    void worker(llvm::TargetMachine* tm)
+    {
+        llvm::LLVMContext context;
+        for (;;)
         {
-            llvm::Value* dataptr = builder.CreateLoad(dataptr_addr, "dataptr");
-            llvm::Value* element_addr =
-                builder.CreateInBoundsGEP(memory, { dataptr }, "element_addr");
-            llvm::Value* element = builder.CreateLoad(element_addr, "element");
-            llvm::Value* element_i32 =
-                builder.CreateIntCast(element, int32_type, false, "element_i32");
-            builder.CreateCall(putchar_fn, element_i32);
-            break;
+            BatchJob* job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                queued_cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+                if (stop_)
+                    return;
+                job = queue_.front();
+                queue_.pop_front();
+            }
+
+            job->times.restart();
+            job->object = compile(*tm, context, *job->program, job->times);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                compiled_.insert(job);
+            }
+            compiled_cv_.notify_all();
         }
-        case ',':
+    }
+
+    /// Compile `p` to an object file with `tm`, or load it from the object cache.
+    std::unique_ptr<llvm::MemoryBuffer> compile(llvm::TargetMachine& tm,
+                                                llvm::LLVMContext& context,
+                                                const BFProgram& p, PhaseTimes& times)
+    {
+        std::string module_name = "bf_module";
+        if (cache_)
         {
-            llvm::Value* user_input = builder.CreateCall(getchar_fn, {}, "user_input");
-            llvm::Value* user_input_i8 =
-                builder.CreateIntCast(user_input, int8_type, false, "user_input_i8");
-            llvm::Value* dataptr = builder.CreateLoad(dataptr_addr, "dataptr");
-            llvm::Value* element_addr =
-                builder.CreateInBoundsGEP(memory, { dataptr }, "element_addr");
-            builder.CreateStore(user_input_i8, element_addr);
-            break;
+            module_name = cache_key(tm, p);
+            std::unique_ptr<llvm::MemoryBuffer> cached_object =
+                cache_->getCachedObject(module_name);
+            if (cached_object)
+            {
+                times.record("load");
+                return cached_object;
+            }
         }
-        case '[':
+
+        std::unique_ptr<llvm::Module> module =
+            build_module(p, module_name, context, tm.createDataLayout(), times);
+        llvm::orc::SimpleCompiler compiler(tm, cache_);
+        std::unique_ptr<llvm::MemoryBuffer> object = compiler(*module);
+        times.record("codegen");
+        return object;
+    }
+
+    BFObjectCache* cache_;
+    std::vector<std::unique_ptr<llvm::TargetMachine>> target_machines_;
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable queued_cv_;
+    std::condition_variable compiled_cv_;
+    std::deque<BatchJob*> queue_;
+    std::deque<BatchJob*> submitted_;
+    std::set<BatchJob*> compiled_;
+    bool stop_;
+};
+
+/// Read the next job from a batch manifest. Each non-empty line that does not start
+/// with '#' names a program, optionally followed by a file to use as its input
+/// (empty input otherwise) and a file to write its output to (stdout otherwise).
+/// Returns nullptr at the end of the manifest; jobs whose files cannot be opened
+/// are reported, counted in `failures` and skipped.
+static std::unique_ptr<BatchJob> read_job(std::istream& manifest, unsigned& failures)
+{
+    std::string line;
+    while (std::getline(manifest, line))
+    {
+        std::istringstream fields(line);
+        std::string program_path, input_path, output_path;
+        fields >> program_path >> input_path >> output_path;
+        if (program_path.empty() || program_path[0] == '#')
+            continue;
+
+        std::unique_ptr<BatchJob> job(new BatchJob);
+        job->line = line;
+        std::ifstream file(program_path);
+        job->input_fd = open(input_path.empty() ? "/dev/null" : input_path.c_str(),
+                             O_RDONLY);
+        job->output =
+            output_path.empty() ? stdout : fopen(output_path.c_str(), "wb");
+        if (!file || job->input_fd < 0 || !job->output)
         {
-            llvm::Value* dataptr = builder.CreateLoad(dataptr_addr, "dataptr");
-            llvm::Value* element_addr =
-                builder.CreateInBoundsGEP(memory, { dataptr }, "element_addr");
-            llvm::Value* element = builder.CreateLoad(element_addr, "element");
-            llvm::Value* cmp = builder.CreateICmpEQ(element, builder.getInt8(0));
-            llvm::BasicBlock* loop_body_block =
-                llvm::BasicBlock::Create(context, "loop_body", jit_fn);
-            llvm::BasicBlock* loop_exit_block =
-                llvm::BasicBlock::Create(context, "loop_exit", jit_fn);
-            builder.CreateCondBr(cmp, loop_exit_block, loop_body_block);
-            open_bracket_stack.push(std::make_pair(loop_body_block, loop_exit_block));
-            // This specifies that following created instructions should be appended to
-            // the end of the specified block.
-            builder.SetInsertPoint(loop_body_block);
-            break;
+            llvm::errs() << "bf-jit: cannot open the files of job '" << line << "'\n";
+            if (job->input_fd >= 0)
+                close(job->input_fd);
+            if (job->output && job->output != stdout)
+                fclose(job->output);
+            ++failures;
+            continue;
         }
-        case ']':
+
+        job->program.reset(new BFProgram);
+        if (!load_program(file, program_path, *job->program))
         {
-            BracketBlocks blocks = open_bracket_stack.top();
-            open_bracket_stack.pop();
-            llvm::Value* dataptr = builder.CreateLoad(dataptr_addr, "dataptr");
-            llvm::Value* element_addr =
-                builder.CreateInBoundsGEP(memory, { dataptr }, "element_addr");
-            llvm::Value* element = builder.CreateLoad(element_addr, "element");
-            llvm::Value* cmp = builder.CreateICmpNE(element, builder.getInt8(0));
-            builder.CreateCondBr(cmp, blocks.first, blocks.second);
-            // This specifies that following created instructions should be appended to
-            // the end of the specified block.
-            builder.SetInsertPoint(blocks.second);
-            break;
-        }
-        default:
-            assert(0 && "unreachable!");
+            close(job->input_fd);
+            if (job->output != stdout)
+                fclose(job->output);
+            ++failures;
+            continue;
         }
+        job->times.record("parse");
+        return job;
     }
-
-    builder.CreateRetVoid();
-    return jit_fn;
+    return nullptr;
 }
 
-void llvm_jit(const BFProgram& p)
+/// Run every job of a batch manifest on the same JIT. Up to `workers` programs are
+/// compiled in parallel, ahead of the one that is running; programs run one at a
+/// time, in manifest order, and each program's module is removed from the JIT
+/// once it has run. Returns the number of jobs that could not be run.
+static unsigned run_batch(std::istream& manifest, BrainfuckJIT& jit, BFObjectCache* cache,
+                          unsigned workers)
 {
-    llvm::LLVMContext context;
-    std::unique_ptr<llvm::Module> module(new llvm::Module("bf_module", context));
+    ParallelCompiler compiler(workers, cache);
+    std::deque<std::unique_ptr<BatchJob>> pending;
+    unsigned failures = 0;
+    bool end_of_manifest = false;
+    for (;;)
+    {
+        // Keep every worker busy, without reading the whole manifest up front.
+        while (!end_of_manifest && pending.size() < 2 * workers)
+        {
+            std::unique_ptr<BatchJob> job = read_job(manifest, failures);
+            if (!job)
+            {
+                end_of_manifest = true;
+                break;
+            }
+            compiler.submit(job.get());
+            pending.push_back(std::move(job));
+        }
+        if (pending.empty())
+            break;
 
-    // Add a declaration for external functions used in the JITed code. We use
-    // putchar and getchar for I/O.
-    llvm::Type* int32_type = llvm::Type::getInt32Ty(context);
-    llvm::Function* putchar_fn =
-        llvm::Function::Create(llvm::FunctionType::get(int32_type, { int32_type }, false),
-                               llvm::Function::ExternalLinkage, "putchar", module.get());
-    llvm::Function* getchar_fn =
-        llvm::Function::Create(llvm::FunctionType::get(int32_type, {}, false),
-                               llvm::Function::ExternalLinkage, "getchar", module.get());
+        BatchJob* job = compiler.take();
+        assert(job == pending.front().get() && "jobs are compiled out of order");
+        job->times.restart();
+        llvm::orc::VModuleKey key = jit.addObject(std::move(job->object));
+        JitFuncType jit_func_ptr = lookup_program(jit, key);
+        job->times.record("link");
+        set_runtime_io(job->input_fd, job->output);
+        if (!run_program(jit_func_ptr, job->times))
+            ++failures;
+        set_runtime_io(STDIN_FILENO, stdout);
+        jit.removeModule(key);
 
-    // Compile the BF program to LLVM IR.
-    llvm::Function* jit_fn = emit_jit_function(p, module.get(), putchar_fn, getchar_fn);
+        close(job->input_fd);
+        if (job->output != stdout)
+            fclose(job->output);
+        if (TimePhases)
+        {
+            llvm::errs() << job->line << ":\n";
+            job->times.print(llvm::errs());
+        }
+        pending.pop_front();
+    }
+    return failures;
+}
 
-    llvm::verifyFunction(*jit_fn);
+int main(int argc, const char** argv)
+{
+    llvm::cl::ParseCommandLineOptions(argc, argv, "A JIT for brainfuck using LLVM.\n");
+    if (InputFilename.empty() == BatchManifest.empty())
+    {
+        llvm::errs() << "bf-jit: expected either a program or -batch=<manifest>\n";
+        return 1;
+    }
+    // Lazily compiled loops live in the JIT for good, so their names cannot be
+    // reused by the next program of a batch.
+    if (Lazy && !BatchManifest.empty())
+    {
+        llvm::errs() << "bf-jit: -lazy cannot be combined with -batch\n";
+        return 1;
+    }
+    bool standalone = !EmitObj.empty() || !EmitExe.empty();
+    if (standalone && !BatchManifest.empty())
+    {
+        llvm::errs() << "bf-jit: -emit-obj and -emit-exe take a single program and "
+                        "cannot be combined with -batch\n";
+        return 1;
+    }
+    if (standalone && Lazy)
+    {
+        llvm::errs() << "bf-jit: -emit-obj and -emit-exe cannot be combined with "
+                        "-lazy\n";
+        return 1;
+    }
+    if (!ProfileOutput.empty() && (standalone || !BatchManifest.empty()))
+    {
+        llvm::errs() << "bf-jit: -profile only works when running a single program\n";
+        return 1;
+    }
+    if (CellBits != 8 && CellBits != 16 && CellBits != 32)
+    {
+        llvm::errs() << "bf-jit: -cell-bits must be 8, 16 or 32\n";
+        return 1;
+    }
+    if (tape_bytes() > std::numeric_limits<size_t>::max())
+    {
+        llvm::errs() << "bf-jit: -max-tape-size is too large for " << CellBits
+                     << "-bit cells\n";
+        return 1;
+    }
 
-    // Optimize the emitted LLVM IR.
+    // The target and the JIT are set up once, however many programs are run.
+    PhaseTimes times;
     llvm::InitializeNativeTarget();
     llvm::InitializeNativeTargetAsmPrinter();
     llvm::InitializeNativeTargetAsmParser();
 
-    llvm::PassManagerBuilder pm_builder;
-    pm_builder.OptLevel = 3;
-    pm_builder.SizeLevel = 0;
-
-    llvm::legacy::FunctionPassManager function_pm(module.get());
-    llvm::legacy::PassManager module_pm;
-    pm_builder.populateFunctionPassManager(function_pm);
-    pm_builder.populateModulePassManager(module_pm);
-
-    function_pm.doInitialization();
-    function_pm.run(*jit_fn);
-    module_pm.run(*module);
+    std::unique_ptr<BFObjectCache> cache;
+    if (!ObjectCacheDir.empty())
+        cache.reset(new BFObjectCache(ObjectCacheDir));
+    BrainfuckJIT jit(cache.get());
+    jit.getTargetMachine().setOptLevel(codegen_opt_level(Pipeline));
+    add_runtime_symbols(jit);
+    times.record("init");
 
-    // JIT the optimized LLVM IR to native code and execute it.
-    BrainfuckJIT jit;
-    module->setDataLayout(jit.getTargetMachine().createDataLayout());
-    jit.addModule(std::move(module));
-    using JitFuncType = void (*)(void);
-    JitFuncType jit_func_ptr =
-        reinterpret_cast<JitFuncType>(jit.getSymbolAddress(JIT_FUNC_NAME));
-    assert(jit_func_ptr && "Failed to codegen function");
-    jit_func_ptr();
-}
+    if (!BatchManifest.empty())
+    {
+        if (TimePhases)
+            times.print(llvm::errs());
+        unsigned workers = Jobs != 0 ? Jobs : std::thread::hardware_concurrency();
+        workers = std::max(workers, 1u);
+        if (BatchManifest == "-")
+            return run_batch(std::cin, jit, cache.get(), workers) == 0 ? 0 : 1;
+        std::ifstream manifest(BatchManifest);
+        if (!manifest)
+        {
+            llvm::errs() << "bf-jit: cannot open '" << BatchManifest << "'\n";
+            return 1;
+        }
+        return run_batch(manifest, jit, cache.get(), workers) == 0 ? 0 : 1;
+    }
 
-int main(int argc, const char** argv)
-{
-    if (argc == 2)
+    llvm::LLVMContext context;
+    std::ifstream file(InputFilename);
+    if (!file)
     {
-        std::ifstream file(argv[1]);
-        BFProgram program = parse_from_stream(file);
-        llvm_jit(program);
+        llvm::errs() << "bf-jit: cannot open '" << InputFilename << "'\n";
+        return 1;
+    }
+    BFProgram program;
+    if (!load_program(file, InputFilename, program))
+        return 1;
+    times.record("parse");
+    if (standalone)
+    {
+        // The program is compiled by the JIT's TargetMachine, but not run.
+        bool emitted = emit_standalone(jit.getTargetMachine(), program, times);
+        if (TimePhases)
+            times.print(llvm::errs());
+        return emitted ? 0 : 1;
+    }
+    // The emitted code counts into this array, see BFProfile.h.
+    BFProfileCounts profile_counts(program.ops.size(), 0);
+    if (!ProfileOutput.empty())
+        jit.addRuntimeSymbol(RUNTIME_PROFILE_COUNTS_NAME, profile_counts.data());
+    JitFuncType jit_func_ptr = compile_program(jit, cache.get(), context, program, times);
+    if (!run_program(jit_func_ptr, times))
+        return 1;
+    if (TimePhases)
+        times.print(llvm::errs());
+    if (!ProfileOutput.empty())
+    {
+        write_hot_loops(program, profile_counts, std::cerr);
+        std::ofstream profile(ProfileOutput);
+        write_flame_graph(program, profile_counts, profile);
     }
 
     return 0;
-}
\ No newline at end of file
+}
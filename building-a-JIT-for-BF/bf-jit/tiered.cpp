@@ -0,0 +1,194 @@
+#include "../bf-interpreter/BFInterpreter.h"
+#include "BFCodegen.h"
+#include "BFJit.h"
+#include "BFProgram.h"
+#include "BFRuntime.h"
+#include "BFSnapshot.h"
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <csignal>
+#include <deque>
+#include <fstream>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+static llvm::cl::opt<std::string> InputFilename(llvm::cl::Positional,
+                                                llvm::cl::desc("<filename>.bf"),
+                                                llvm::cl::Required);
+static llvm::cl::opt<bool> DisableLoopIdioms(
+    "disable-loop-idioms",
+    llvm::cl::desc("Emit clear, multiply and scan loops as plain loops"));
+static llvm::cl::opt<unsigned> HotLoopThreshold(
+    "hot-loop-threshold", llvm::cl::init(1000),
+    llvm::cl::desc("Number of back-edges after which a loop is compiled"));
+static llvm::cl::opt<std::string> CheckpointFilename(
+    "checkpoint",
+    llvm::cl::desc("On SIGINT or SIGTERM, save the execution state to this file and "
+                   "exit with status 75"),
+    llvm::cl::value_desc("filename"));
+static llvm::cl::opt<std::string> RestoreFilename(
+    "restore", llvm::cl::desc("Resume the program from a -checkpoint file"),
+    llvm::cl::value_desc("filename"));
+
+/// Set by SIGINT and SIGTERM when the run is to be checkpointed.
+static std::atomic<bool> stop_requested(false);
+
+static void request_stop(int)
+{
+    stop_requested.store(true, std::memory_order_relaxed);
+}
+
+/// Compiles the hot loops reported by the interpreter on a background thread and
+/// installs the native code back into the interpreter. The thread owns its own
+/// LLVMContext and BrainfuckJIT, so the interpreter never waits for LLVM.
+class BackgroundLoopCompiler : public BFLoopCompiler
+{
+public:
+    BackgroundLoopCompiler(const BFProgram& program, BFInterpreter& interpreter)
+        : program_(program), interpreter_(interpreter), stop_(false),
+          thread_(&BackgroundLoopCompiler::worker, this)
+    {
+    }
+
+    /// Drops the loops that are still queued and waits for the one being compiled.
+    ~BackgroundLoopCompiler()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+            queue_.clear();
+        }
+        cv_.notify_one();
+        thread_.join();
+    }
+
+    void compileLoop(size_t begin) override
+    {
+        // The runtime reads input ahead in blocks, which would steal bytes from the
+        // interpreter's std::cin, so loops that read input stay interpreted.
+        for (size_t pc = begin; pc < program_.ops[begin].match; ++pc)
+        {
+            if (program_.ops[pc].kind == BFOpKind::Input)
+                return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.push_back(begin);
+        }
+        cv_.notify_one();
+    }
+
+private:
+    void worker()
+    {
+        llvm::LLVMContext context;
+        BrainfuckJIT jit;
+        add_runtime_symbols(jit);
+
+        for (;;)
+        {
+            size_t begin;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+                if (stop_)
+                    return;
+                begin = queue_.front();
+                queue_.pop_front();
+            }
+
+            std::unique_ptr<llvm::Module> module(
+                new llvm::Module("bf_loop_module", context));
+            BFRuntimeDecls runtime = declare_runtime(module.get());
+            llvm::Function* loop_fn =
+                emit_loop_function(program_, begin, module.get(), runtime);
+            llvm::verifyFunction(*loop_fn);
+            optimize_module(module.get(), BFPipeline::O3);
+
+            module->setDataLayout(jit.getTargetMachine().createDataLayout());
+            jit.addModule(std::move(module));
+            BFNativeLoop native = reinterpret_cast<BFNativeLoop>(
+                jit.getSymbolAddress(loop_function_name(begin)));
+            assert(native && "Failed to codegen loop function");
+            interpreter_.installLoop(begin, native);
+        }
+    }
+
+    const BFProgram& program_;
+    BFInterpreter& interpreter_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<size_t> queue_;
+    bool stop_;
+    std::thread thread_;
+};
+
+int main(int argc, const char** argv)
+{
+    llvm::cl::ParseCommandLineOptions(
+        argc, argv, "Run brainfuck in an interpreter that tiers up hot loops to LLVM.\n");
+
+    std::ifstream file(InputFilename);
+    if (!file)
+    {
+        llvm::errs() << "bf-tiered: cannot open '" << InputFilename << "'\n";
+        return 1;
+    }
+    BFProgram program;
+    BFParseError error;
+    if (!parse_from_stream(file, program, error))
+    {
+        llvm::errs() << error.describe(InputFilename) << "\n";
+        return 1;
+    }
+    if (!DisableLoopIdioms)
+        program.ops = recognize_loop_idioms(program.ops);
+
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+
+    BFInterpreter interpreter;
+    BackgroundLoopCompiler compiler(program, interpreter);
+    interpreter.setLoopCompiler(&compiler, HotLoopThreshold);
+    if (!CheckpointFilename.empty())
+    {
+        interpreter.setStopRequest(&stop_requested);
+        std::signal(SIGINT, request_stop);
+        std::signal(SIGTERM, request_stop);
+    }
+    interpreter.load(program);
+    if (!RestoreFilename.empty())
+    {
+        BFSnapshot snapshot;
+        std::string message;
+        if (!read_snapshot(RestoreFilename, snapshot, message) ||
+            !interpreter.restore(snapshot, message))
+        {
+            llvm::errs() << "bf-tiered: cannot restore: " << message << "\n";
+            return 1;
+        }
+    }
+
+    if (!interpreter.run())
+    {
+        std::string message;
+        if (!write_snapshot(CheckpointFilename, interpreter.snapshot(), message))
+        {
+            llvm::errs() << "bf-tiered: cannot checkpoint: " << message << "\n";
+            return 1;
+        }
+        return 75;  // EX_TEMPFAIL: resume later with -restore
+    }
+
+    return 0;
+}
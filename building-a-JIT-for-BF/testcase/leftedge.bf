@@ -0,0 +1,10 @@
+Multiply loops at the left edge of the tape
+The current cell is 0 at each of them so none of them runs and none may touch
+the cells to the left of the first one
+
+[<+>-]
+[<<++<+++>>>-]
+>[<<<<+>>>>-]<
+
+Print ok and a newline
+++++++++++[>+++++++++++<-]>+.----.[-]++++++++++.
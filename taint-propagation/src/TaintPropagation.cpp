@@ -11,6 +11,13 @@
 //===----------------------------------------------------------------------===//
 
 #include "TaintPropagation.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/FoldingSet.h"
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/ADT/SparseBitVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/CallGraph.h"
 #include "llvm/Analysis/IteratedDominanceFrontier.h"
 #include "llvm/Analysis/SparsePropagation.h"
 #include "llvm/IR/Dominators.h"
@@ -19,7 +26,14 @@
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/IR/MDBuilder.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Transforms/IPO.h"
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 using namespace llvm;
 
@@ -28,32 +42,117 @@ using namespace llvm;
 constexpr char MD_TAINT[] = "taint";
 
 /// The maximum number of instructions to track per lattice value. Once the number exceeds
-/// this threshold, the lattice value becomes overdefined.
+/// this threshold, the lattice value becomes overdefined, which is tainted everywhere.
 static cl::opt<unsigned> MaxInstructionsPerValue(
     "max-instructions-per-value", cl::Hidden, cl::init(128),
     cl::desc("The maximum number of instructions to track per lattice value"));
 
-/// Cache that map Function to its DominatorTree
-static std::unordered_map<Function *, DominatorTree> FnToDTMap;
-
-/// Return if any one of DefInsts can reach UseInst
-/// A DefInst can reach a UseInst only if the UseInst is dominated by the DefInst or one
-/// of its iterated dominance frontiers
-/// NOTE:
-/// - Specail case: if DefInsts is empty, we consider DefInsts can reach UseInst
-/// - UseInst should not occur in DefInsts
-static bool reachable(const std::vector<Instruction *> &DefInsts, Instruction *UseInst)
+/// The number of threads solving call-graph SCCs concurrently. With one thread, a
+/// single solver solves the whole module.
+static cl::opt<unsigned> TaintThreads(
+    "taint-threads", cl::init(0),
+    cl::desc("Number of threads solving call-graph SCCs concurrently; 0 uses every "
+             "core, 1 solves the module with a single solver"));
+
+STATISTIC(NumSummariesComputed, "Number of function summaries computed");
+
+/// ReachabilityIndex - Answer whether any one of a set of defining instructions can
+/// reach a use. A DefInst can reach a UseInst only if the UseInst is dominated by the
+/// DefInst or one of its iterated dominance frontiers.
+/// The DominatorTree of each function is built once, and the iterated dominance
+/// frontiers are memoized by the set of defining blocks, as the solver asks the same
+/// question for the same lattice values over and over again.
+class ReachabilityIndex
 {
-    if (DefInsts.empty())
-        return true;
+public:
+    /// Return if any one of DefInsts can reach UseInst
+    /// NOTE:
+    /// - Specail case: if DefInsts is empty, we consider DefInsts can reach UseInst
+    /// - UseInst should not occur in DefInsts
+    /// The cached DominatorTree is reused as is. The solver only adds metadata and
+    /// never changes the CFG; anything else must call invalidate() after doing so.
+    bool reachable(ArrayRef<Instruction *> DefInsts, Instruction *UseInst);
+
+    /// Build the DominatorTree of every function of M up front. Afterwards queries
+    /// for uses in different functions may run concurrently, as long as the CFG is
+    /// not changed, which the solver never does.
+    void prepare(Module &M)
+    {
+        for (Function &F : M)
+            if (!F.isDeclaration())
+                getFunctionIndex(&F);
+    }
+
+    /// Drop the cached DominatorTree and IDF sets of F. This must be called whenever
+    /// the CFG of F is changed.
+    void invalidate(Function *F)
+    {
+        FnIndexes.erase(F);
+    }
 
-    Function *F = UseInst->getFunction();
-    if (FnToDTMap.find(F) == FnToDTMap.end())
+    /// Drop everything cached.
+    void clear()
     {
-        FnToDTMap.emplace(std::make_pair(F, DominatorTree(*F)));
+        FnIndexes.clear();
     }
 
-    DominatorTree &DT = FnToDTMap[F];
+private:
+    struct FunctionIndex
+    {
+        explicit FunctionIndex(Function &F) : DT(F) {}
+
+        DominatorTree DT;
+
+        /// Map a sorted set of defining blocks to its iterated dominance frontiers.
+        std::map<std::vector<BasicBlock *>, std::vector<BasicBlock *>> IDFCache;
+    };
+
+    /// Return the index of F, building it if it is missing.
+    FunctionIndex &getFunctionIndex(Function *F);
+
+    /// Return the iterated dominance frontiers of the sorted DefBlocks.
+    const std::vector<BasicBlock *> &getIDF(FunctionIndex &FI,
+                                            std::vector<BasicBlock *> &&DefBlocks);
+
+    std::unordered_map<Function *, std::unique_ptr<FunctionIndex>> FnIndexes;
+};
+
+ReachabilityIndex::FunctionIndex &ReachabilityIndex::getFunctionIndex(Function *F)
+{
+    // Look up first, as only find() is safe to run concurrently after prepare().
+    auto It = FnIndexes.find(F);
+    if (It != FnIndexes.end())
+        return *It->second;
+    std::unique_ptr<FunctionIndex> &FI = FnIndexes[F];
+    FI.reset(new FunctionIndex(*F));
+    return *FI;
+}
+
+const std::vector<BasicBlock *> &
+ReachabilityIndex::getIDF(FunctionIndex &FI, std::vector<BasicBlock *> &&DefBlocks)
+{
+    auto It = FI.IDFCache.find(DefBlocks);
+    if (It != FI.IDFCache.end())
+        return It->second;
+
+    ForwardIDFCalculator IDF(FI.DT);
+    SmallPtrSet<BasicBlock *, 32> Blocks(DefBlocks.begin(), DefBlocks.end());
+    IDF.setDefiningBlocks(Blocks);
+    SmallVector<BasicBlock *, 32> IDFBlocks;
+    IDF.calculate(IDFBlocks);
+    std::vector<BasicBlock *> &Result = FI.IDFCache[std::move(DefBlocks)];
+    Result.assign(IDFBlocks.begin(), IDFBlocks.end());
+    return Result;
+}
+
+bool ReachabilityIndex::reachable(ArrayRef<Instruction *> DefInsts,
+                                  Instruction *UseInst)
+{
+    if (DefInsts.empty())
+        return true;
+
+    FunctionIndex &FI = getFunctionIndex(UseInst->getFunction());
+    DominatorTree &DT = FI.DT;
     for (auto I : DefInsts)
     {
         // An instruction doesn't dominate a use in itself.
@@ -61,27 +160,387 @@ static bool reachable(const std::vector<Instruction *> &DefInsts, Instruction *U
             return true;
     }
 
-    ForwardIDFCalculator IDF(DT);
-    SmallPtrSet<BasicBlock *, 32> Blocks;
+    std::vector<BasicBlock *> DefBlocks;
+    DefBlocks.reserve(DefInsts.size());
     for (auto I : DefInsts)
     {
         // If this DefInst is exactly the UseInst, skip
         if (I == UseInst)
             continue;
-        Blocks.insert(I->getParent());
+        DefBlocks.push_back(I->getParent());
     }
-    IDF.setDefiningBlocks(Blocks);
-    SmallVector<BasicBlock *, 32> IDFBlocks;
-    IDF.calculate(IDFBlocks);
-    for (auto *BB : IDFBlocks)
+    std::sort(DefBlocks.begin(), DefBlocks.end());
+    DefBlocks.erase(std::unique(DefBlocks.begin(), DefBlocks.end()), DefBlocks.end());
+
+    BasicBlock *UseBB = UseInst->getParent();
+    for (auto *BB : getIDF(FI, std::move(DefBlocks)))
     {
-        if (DT.dominates(BB, UseInst->getParent()))
+        if (DT.dominates(BB, UseBB))
             return true;
     }
 
     return false;
 }
 
+/// ValueDependencyGraph - Map a value to the set of values that the value depends on,
+/// directly or transitively. The direct dependencies are recorded while walking the
+/// module, then the graph is condensed into strongly connected components. The
+/// transitive closure of each component is a bitset over dense value IDs, computed on
+/// the first query and memoized.
+class ValueDependencyGraph
+{
+public:
+    /// Record that V directly depends on Dep.
+    void addDependency(Value *V, Value *Dep)
+    {
+        unsigned ID = getOrCreateID(V);
+        unsigned DepID = getOrCreateID(Dep);
+        Deps[ID].push_back(DepID);
+    }
+
+    /// Condense the graph into SCCs. Must be called once after the last
+    /// addDependency() and before the first getDependency().
+    void finalize();
+
+    /// Return true if V depends on any value.
+    bool hasDependency(Value *V) const
+    {
+        auto It = IDs.find(V);
+        return It != IDs.end() && !Deps[It->second].empty();
+    }
+
+    /// Return the IDs of the values that V depends on. V must have a dependency.
+    /// Safe to call concurrently.
+    const SparseBitVector<> &getDependency(Value *V);
+
+    /// Return the value numbered ID.
+    Value *getValue(unsigned ID) const
+    {
+        return Values[ID];
+    }
+
+private:
+    unsigned getOrCreateID(Value *V)
+    {
+        auto Inserted = IDs.insert(std::make_pair(V, Values.size()));
+        if (Inserted.second)
+        {
+            Values.push_back(V);
+            Deps.emplace_back();
+        }
+        return Inserted.first->second;
+    }
+
+    /// Compute the closure of SCC from the closures of its successors.
+    void computeClosure(unsigned SCC);
+
+    /// Dense value numbering.
+    DenseMap<Value *, unsigned> IDs;
+    std::vector<Value *> Values;
+
+    /// The direct dependencies of each value.
+    std::vector<SmallVector<unsigned, 2>> Deps;
+
+    /// The SCC of each value. SCCs are numbered in reverse topological order, so the
+    /// SCCs a value depends on always have smaller numbers than its own SCC.
+    std::vector<unsigned> SCCOf;
+
+    /// The values in each SCC.
+    std::vector<SmallVector<unsigned, 1>> SCCMembers;
+
+    /// Whether each SCC lies on a cycle, in which case its values depend on themselves.
+    std::vector<bool> SCCCyclic;
+
+    /// Memoized closure of each SCC, valid when ClosureComputed is set. A closure
+    /// never changes once computed, so it is read without taking ClosureMutex.
+    std::vector<SparseBitVector<>> Closures;
+    std::unique_ptr<std::atomic<bool>[]> ClosureComputed;
+
+    /// Serializes computing the closures.
+    std::mutex ClosureMutex;
+};
+
+void ValueDependencyGraph::finalize()
+{
+    // Iterative Tarjan. Long GEP/cast chains would overflow the stack otherwise.
+    const unsigned NumValues = Values.size();
+    const unsigned Unvisited = ~0U;
+    std::vector<unsigned> Index(NumValues, Unvisited), LowLink(NumValues);
+    std::vector<bool> OnStack(NumValues, false);
+    std::vector<unsigned> Stack;
+    std::vector<std::pair<unsigned, unsigned>> CallStack;
+    unsigned NextIndex = 0;
+
+    SCCOf.assign(NumValues, 0);
+    SCCMembers.clear();
+    SCCCyclic.clear();
+    for (unsigned Root = 0; Root != NumValues; ++Root)
+    {
+        if (Index[Root] != Unvisited)
+            continue;
+        CallStack.push_back(std::make_pair(Root, 0U));
+        while (!CallStack.empty())
+        {
+            unsigned V = CallStack.back().first;
+            unsigned &NextDep = CallStack.back().second;
+            if (NextDep == 0 && Index[V] == Unvisited)
+            {
+                Index[V] = LowLink[V] = NextIndex++;
+                Stack.push_back(V);
+                OnStack[V] = true;
+            }
+            if (NextDep < Deps[V].size())
+            {
+                unsigned W = Deps[V][NextDep++];
+                if (Index[W] == Unvisited)
+                    CallStack.push_back(std::make_pair(W, 0U));
+                else if (OnStack[W])
+                    LowLink[V] = std::min(LowLink[V], Index[W]);
+                continue;
+            }
+
+            if (LowLink[V] == Index[V])
+            {
+                unsigned SCC = SCCMembers.size();
+                SCCMembers.emplace_back();
+                unsigned W;
+                do
+                {
+                    W = Stack.back();
+                    Stack.pop_back();
+                    OnStack[W] = false;
+                    SCCOf[W] = SCC;
+                    SCCMembers.back().push_back(W);
+                } while (W != V);
+                bool SelfLoop =
+                    std::find(Deps[V].begin(), Deps[V].end(), V) != Deps[V].end();
+                SCCCyclic.push_back(SCCMembers.back().size() > 1 || SelfLoop);
+            }
+            CallStack.pop_back();
+            if (!CallStack.empty())
+            {
+                unsigned Parent = CallStack.back().first;
+                LowLink[Parent] = std::min(LowLink[Parent], LowLink[V]);
+            }
+        }
+    }
+
+    Closures.clear();
+    Closures.resize(SCCMembers.size());
+    ClosureComputed.reset(new std::atomic<bool>[SCCMembers.size()]());
+}
+
+void ValueDependencyGraph::computeClosure(unsigned SCC)
+{
+    SparseBitVector<> &Closure = Closures[SCC];
+    if (SCCCyclic[SCC])
+    {
+        for (unsigned V : SCCMembers[SCC])
+            Closure.set(V);
+    }
+    for (unsigned V : SCCMembers[SCC])
+    {
+        for (unsigned W : Deps[V])
+        {
+            unsigned DepSCC = SCCOf[W];
+            if (DepSCC == SCC)
+                continue;
+            assert(ClosureComputed[DepSCC].load(std::memory_order_relaxed) &&
+                   "SCCs not in reverse topological order");
+            Closure.set(W);
+            Closure |= Closures[DepSCC];
+        }
+    }
+    ClosureComputed[SCC].store(true, std::memory_order_release);
+}
+
+const SparseBitVector<> &ValueDependencyGraph::getDependency(Value *V)
+{
+    unsigned SCC = SCCOf[IDs.find(V)->second];
+    if (ClosureComputed[SCC].load(std::memory_order_acquire))
+        return Closures[SCC];
+
+    std::lock_guard<std::mutex> Lock(ClosureMutex);
+    if (ClosureComputed[SCC].load(std::memory_order_relaxed))
+        return Closures[SCC];
+
+    // Collect the SCCs whose closures are still missing, then compute them in
+    // reverse topological order so that every dependency is ready before its users.
+    SmallVector<unsigned, 16> Pending;
+    SmallVector<unsigned, 16> Worklist;
+    SmallDenseSet<unsigned, 16> Seen;
+    Worklist.push_back(SCC);
+    Seen.insert(SCC);
+    while (!Worklist.empty())
+    {
+        unsigned Cur = Worklist.pop_back_val();
+        Pending.push_back(Cur);
+        for (unsigned Member : SCCMembers[Cur])
+        {
+            for (unsigned W : Deps[Member])
+            {
+                unsigned DepSCC = SCCOf[W];
+                if (!ClosureComputed[DepSCC].load(std::memory_order_relaxed) &&
+                    Seen.insert(DepSCC).second)
+                {
+                    Worklist.push_back(DepSCC);
+                }
+            }
+        }
+    }
+    std::sort(Pending.begin(), Pending.end());
+    for (unsigned Each : Pending)
+        computeClosure(Each);
+    return Closures[SCC];
+}
+
+/// The summary of a function's effect on its callers. The return value and globals
+/// are lattice keys of their own and need no summary. What callers cannot see
+/// without one is a write through a pointer argument.
+struct FunctionTaintSummary
+{
+    /// Pointer arguments whose pointee the function, or a function it calls, may
+    /// write to. If such a formal argument is tainted, so is the actual argument at
+    /// every call site.
+    BitVector WrittenArgs;
+};
+
+/// TaintSummaries - Compute function summaries bottom-up over the call-graph SCCs.
+/// The summaries only tell the solver where to write back; every function body is
+/// still solved, as its own instructions need their !taint metadata.
+class TaintSummaries
+{
+public:
+    /// Compute the summaries of the functions in M.
+    void compute(Module &M, ValueDependencyGraph &ValueDependencies);
+
+    /// Return the summary of F, or nullptr if F has no exact definition.
+    const FunctionTaintSummary *lookup(const Function *F) const
+    {
+        auto It = Summaries.find(F);
+        return It != Summaries.end() ? &It->second : nullptr;
+    }
+
+private:
+    /// Recompute the summary of F from its body and the current summaries of its
+    /// callees. Return true if it changed.
+    bool updateSummary(Function &F, ValueDependencyGraph &ValueDependencies);
+
+    DenseMap<const Function *, FunctionTaintSummary> Summaries;
+};
+
+bool TaintSummaries::updateSummary(Function &F, ValueDependencyGraph &ValueDependencies)
+{
+    FunctionTaintSummary &Summary = Summaries[&F];
+    BitVector WrittenArgs(F.arg_size());
+
+    // Record that F may write through Ptr, and so through the pointer arguments
+    // Ptr depends on.
+    auto AddWrittenPointer = [&](Value *Ptr) {
+        if (auto *Arg = dyn_cast<Argument>(Ptr))
+            WrittenArgs.set(Arg->getArgNo());
+        if (!ValueDependencies.hasDependency(Ptr))
+            return;
+        for (unsigned ID : ValueDependencies.getDependency(Ptr))
+        {
+            auto *Arg = dyn_cast<Argument>(ValueDependencies.getValue(ID));
+            if (Arg && Arg->getParent() == &F && Arg->getType()->isPointerTy())
+                WrittenArgs.set(Arg->getArgNo());
+        }
+    };
+
+    for (inst_iterator i = inst_begin(F), e = inst_end(F); i != e; ++i)
+    {
+        Instruction *I = &*i;
+        if (auto *SI = dyn_cast<StoreInst>(I))
+        {
+            AddWrittenPointer(SI->getPointerOperand());
+            continue;
+        }
+        if (auto *MTI = dyn_cast<MemTransferInst>(I))
+        {
+            AddWrittenPointer(MTI->getOperand(0));
+            continue;
+        }
+        CallSite CS(I);
+        if (!CS)
+            continue;
+        Function *Callee = CS.getCalledFunction();
+        if (!Callee)
+            continue;
+
+        // Taint sources and propagating library calls write to their
+        // destination arguments.
+#define HANDLE_TAINT_SOURCE(FUNC_NAME, ARGS)                                             \
+    do                                                                                   \
+    {                                                                                    \
+        if (Callee->getName().equals(FUNC_NAME))                                         \
+        {                                                                                \
+            std::vector<int8_t> Args(ARGS);                                              \
+            for (const auto &i : Args)                                                   \
+                if (i != -1)                                                             \
+                    AddWrittenPointer(I->getOperand(i));                                 \
+        }                                                                                \
+    } while (false)
+#define HANDLE_TAINT_PROPAGATION_LIBCALL(FUNC_NAME, SRC_ARGS, DST_ARGS)                  \
+    do                                                                                   \
+    {                                                                                    \
+        if (Callee->getName().equals(FUNC_NAME))                                         \
+        {                                                                                \
+            std::vector<int8_t> DstArgs(DST_ARGS);                                       \
+            for (const auto &i : DstArgs)                                                \
+                AddWrittenPointer(I->getOperand(i));                                     \
+        }                                                                                \
+    } while (false)
+#include "Taint.def"
+#undef HANDLE_TAINT_SOURCE
+#undef HANDLE_TAINT_PROPAGATION_LIBCALL
+
+        if (const FunctionTaintSummary *CalleeSummary = lookup(Callee))
+        {
+            for (unsigned ArgNo : CalleeSummary->WrittenArgs.set_bits())
+                if (ArgNo < CS.arg_size())
+                    AddWrittenPointer(CS.getArgument(ArgNo));
+        }
+    }
+
+    if (Summary.WrittenArgs == WrittenArgs)
+        return false;
+    Summary.WrittenArgs = std::move(WrittenArgs);
+    return true;
+}
+
+void TaintSummaries::compute(Module &M, ValueDependencyGraph &ValueDependencies)
+{
+    Summaries.clear();
+    CallGraph CG(M);
+    for (scc_iterator<CallGraph *> I = scc_begin(&CG); !I.isAtEnd(); ++I)
+    {
+        SmallVector<Function *, 4> SCC;
+        for (CallGraphNode *Node : *I)
+        {
+            Function *F = Node->getFunction();
+            if (F && F->hasExactDefinition())
+                SCC.push_back(F);
+        }
+        if (SCC.empty())
+            continue;
+
+        // Callees are summarized before their callers. Within a recursive SCC,
+        // iterate until no summary changes.
+        for (Function *F : SCC)
+            Summaries[F].WrittenArgs.resize(F->arg_size());
+        bool Changed = true;
+        while (Changed)
+        {
+            Changed = false;
+            for (Function *F : SCC)
+                Changed |= updateSummary(*F, ValueDependencies);
+        }
+        NumSummariesComputed += SCC.size();
+    }
+}
+
 /// To enable interprocedural analysis, we assign LLVM values to the following
 /// groups. The register group represents SSA registers, the memory group represents
 /// in-memory values, and the return group represents the return values of functions.
@@ -96,12 +555,188 @@ enum class IPOGrouping : int8_t
 /// Our lattice keys are PointerIntPairs composed of LLVM values and groupings.
 using TaintLatticeKey = PointerIntPair<Value *, 2, IPOGrouping>;
 
+/// A set of instructions a value is tainted at. Sets are uniqued by
+/// TaintedAtSetFactory, so two equal sets are always the same object and lattice
+/// values can hold and compare them by pointer.
+class TaintedAtSet : public FoldingSetNode
+{
+public:
+    TaintedAtSet(SparseBitVector<> &&IDs, std::vector<Instruction *> &&Insts)
+        : IDs(std::move(IDs)), Insts(std::move(Insts))
+    {
+    }
+
+    /// The dense IDs of the instructions, used for word-parallel unions.
+    const SparseBitVector<> &getIDs() const
+    {
+        return IDs;
+    }
+
+    /// The instructions, in ID order.
+    ArrayRef<Instruction *> getInsts() const
+    {
+        return Insts;
+    }
+
+    unsigned size() const
+    {
+        return Insts.size();
+    }
+
+    void Profile(FoldingSetNodeID &ID) const
+    {
+        Profile(ID, IDs);
+    }
+
+    static void Profile(FoldingSetNodeID &ID, const SparseBitVector<> &IDs)
+    {
+        for (unsigned Each : IDs)
+            ID.AddInteger(Each);
+    }
+
+private:
+    SparseBitVector<> IDs;
+    std::vector<Instruction *> Insts;
+};
+
+/// Memoized unions of TaintedAtSets, keyed by the ordered pair of operands. nullptr
+/// means the union was too large.
+using TaintedAtUnionMemo =
+    DenseMap<std::pair<const TaintedAtSet *, const TaintedAtSet *>, const TaintedAtSet *>;
+
+/// TaintedAtSetFactory - Number the instructions of a module and hand out uniqued
+/// TaintedAtSets. The factory is shared by the solvers of all SCCs and is safe to
+/// call concurrently. The uniquing table is split into shards with a lock each, and
+/// looking up a singleton only locks when it creates the set. Unions are memoized by
+/// the caller, so merging two sets that were merged before takes no lock and does
+/// not allocate.
+class TaintedAtSetFactory
+{
+public:
+    explicit TaintedAtSetFactory(Module &M)
+    {
+        for (Function &F : M)
+        {
+            for (inst_iterator i = inst_begin(F), e = inst_end(F); i != e; ++i)
+            {
+                InstIDs[&*i] = Insts.size();
+                Insts.push_back(&*i);
+            }
+        }
+        Singletons.reset(new std::atomic<const TaintedAtSet *>[Insts.size()]());
+    }
+
+    TaintedAtSetFactory(const TaintedAtSetFactory &) = delete;
+    TaintedAtSetFactory &operator=(const TaintedAtSetFactory &) = delete;
+
+    /// Return the set holding only I.
+    const TaintedAtSet *getSingleton(Instruction *I);
+
+    /// Return the union of LHS and RHS, or nullptr if it holds more than MaxSize
+    /// instructions. A null LHS or RHS is the empty set. Memo holds the unions this
+    /// caller computed before.
+    const TaintedAtSet *getUnion(const TaintedAtSet *LHS, const TaintedAtSet *RHS,
+                                 unsigned MaxSize, TaintedAtUnionMemo &Memo);
+
+private:
+    /// Return the uniqued set of the given IDs.
+    const TaintedAtSet *getSet(SparseBitVector<> &&IDs);
+
+    /// Dense instruction numbering.
+    DenseMap<Instruction *, unsigned> InstIDs;
+    std::vector<Instruction *> Insts;
+
+    /// The singleton of each instruction, once created.
+    std::unique_ptr<std::atomic<const TaintedAtSet *>[]> Singletons;
+
+    /// A part of the uniquing table. A set always lives in the shard its hash selects.
+    struct Shard
+    {
+        FoldingSet<TaintedAtSet> Sets;
+        SpecificBumpPtrAllocator<TaintedAtSet> Allocator;
+        std::mutex Mutex;
+    };
+    static constexpr unsigned NumShards = 16;
+    Shard Shards[NumShards];
+};
+
+const TaintedAtSet *TaintedAtSetFactory::getSet(SparseBitVector<> &&IDs)
+{
+    FoldingSetNodeID ID;
+    TaintedAtSet::Profile(ID, IDs);
+    // FoldingSet picks the bucket from the low bits of the hash, so the shard is
+    // picked from the high bits to keep the buckets of every shard in use.
+    Shard &S = Shards[(ID.ComputeHash() >> 24) % NumShards];
+    std::lock_guard<std::mutex> Lock(S.Mutex);
+    void *InsertPos;
+    if (TaintedAtSet *Existing = S.Sets.FindNodeOrInsertPos(ID, InsertPos))
+        return Existing;
+
+    std::vector<Instruction *> SetInsts;
+    for (unsigned Each : IDs)
+        SetInsts.push_back(Insts[Each]);
+    TaintedAtSet *New =
+        new (S.Allocator.Allocate()) TaintedAtSet(std::move(IDs), std::move(SetInsts));
+    S.Sets.InsertNode(New, InsertPos);
+    return New;
+}
+
+const TaintedAtSet *TaintedAtSetFactory::getSingleton(Instruction *I)
+{
+    unsigned ID = InstIDs.find(I)->second;
+    if (const TaintedAtSet *Singleton = Singletons[ID].load(std::memory_order_acquire))
+        return Singleton;
+
+    // Threads racing to create the same singleton get the same uniqued set.
+    SparseBitVector<> IDs;
+    IDs.set(ID);
+    const TaintedAtSet *Singleton = getSet(std::move(IDs));
+    Singletons[ID].store(Singleton, std::memory_order_release);
+    return Singleton;
+}
+
+const TaintedAtSet *TaintedAtSetFactory::getUnion(const TaintedAtSet *LHS,
+                                                  const TaintedAtSet *RHS,
+                                                  unsigned MaxSize,
+                                                  TaintedAtUnionMemo &Memo)
+{
+    if (LHS == RHS || !LHS || !RHS)
+    {
+        const TaintedAtSet *Result = LHS ? LHS : RHS;
+        return Result && Result->size() > MaxSize ? nullptr : Result;
+    }
+    if (RHS < LHS)
+        std::swap(LHS, RHS);
+
+    auto Key = std::make_pair(LHS, RHS);
+    auto It = Memo.find(Key);
+    if (It != Memo.end())
+        return It->second;
+
+    SparseBitVector<> IDs(LHS->getIDs());
+    const TaintedAtSet *Result = nullptr;
+    if (IDs |= RHS->getIDs())
+    {
+        if (IDs.count() <= MaxSize)
+            Result = getSet(std::move(IDs));
+    }
+    else
+    {
+        // RHS is a subset of LHS.
+        Result = LHS;
+    }
+    Memo[Key] = Result;
+    return Result;
+}
+
 /// The lattice value type used by our custom lattice function. It holds the
 /// lattice state, and a set of instructions.
 class TaintLatticeVal
 {
 public:
-    /// The states of the lattice values. Only the Tainted state is interesting.
+    /// The states of the lattice values. Only the Tainted and Overdefined states are
+    /// interesting: an Overdefined value was tainted at too many instructions to track
+    /// them, and is taken to be tainted everywhere.
     enum TaintLatticeStateTy
     {
         Undefined,
@@ -110,38 +745,40 @@ public:
         Untracked
     };
 
-    /// Comparator for sorting the instructions set. We want to keep the order
-    /// deterministic for testing, etc.
-    struct Compare
+    TaintLatticeVal() : LatticeState(Undefined), TaintedAtInsts(nullptr) {}
+    TaintLatticeVal(TaintLatticeStateTy LatticeState)
+        : LatticeState(LatticeState), TaintedAtInsts(nullptr)
     {
-        bool operator()(const Value *LHS, const Value *RHS) const
-        {
-            return LHS < RHS;
-        }
-    };
-
-    TaintLatticeVal() : LatticeState(Undefined) {}
-    TaintLatticeVal(TaintLatticeStateTy LatticeState) : LatticeState(LatticeState) {}
-    TaintLatticeVal(std::vector<Instruction *> &&TaintedAtInsts)
-        : LatticeState(Tainted), TaintedAtInsts(std::move(TaintedAtInsts))
+    }
+    TaintLatticeVal(const TaintedAtSet *TaintedAtInsts)
+        : LatticeState(Tainted), TaintedAtInsts(TaintedAtInsts)
     {
-        assert(std::is_sorted(this->TaintedAtInsts.begin(), this->TaintedAtInsts.end(),
-                              Compare()));
     }
 
-    /// Get a reference to the instructions set held by this lattice value.
+    /// Get the instructions set held by this lattice value.
     /// For states other than Tainted, the number of instructions is zero.
     /// For states Tainted, the number of instructions is non-zero other than the
     /// corresponding lattice key refers to arguments or return values of a function.
-    const std::vector<Instruction *> &getTaintedAtInsts() const
+    ArrayRef<Instruction *> getTaintedAtInsts() const
+    {
+        if (!TaintedAtInsts)
+            return None;
+        return TaintedAtInsts->getInsts();
+    }
+
+    /// Get the uniqued instructions set, or nullptr if it is empty.
+    const TaintedAtSet *getTaintedAtSet() const
     {
         return TaintedAtInsts;
     }
 
-    /// Returns true if the lattice value is in the Tainted state.
+    /// Returns true if the lattice value is in the Tainted or Overdefined state. The
+    /// instructions set of an Overdefined value is empty, so it reaches every use.
+    /// Treating it as untainted instead would make the solution depend on whether
+    /// its users were visited before it overflowed.
     bool isTainted() const
     {
-        return LatticeState == Tainted;
+        return LatticeState == Tainted || LatticeState == Overdefined;
     }
 
     /// Just set the lattic value to Tainted state, there is no change to the instructions
@@ -165,10 +802,10 @@ private:
     /// Holds the state this lattice value is in.
     TaintLatticeStateTy LatticeState;
 
-    /// This set is empty for lattice values in the undefined, overdefined,
+    /// This set is null for lattice values in the undefined, overdefined,
     /// and untracked states. The maximum size of this set is controlled by
     /// MaxInstructionsPerValue.
-    std::vector<Instruction *> TaintedAtInsts;
+    const TaintedAtSet *TaintedAtInsts;
 };
 
 class TaintSolver;
@@ -176,10 +813,15 @@ class TaintSolver;
 /// The custom lattice function used by the TaintSolver.
 /// It handles merging lattice values and computing new lattice values.
 /// It also computes the lattice values that change as a result of executing instructions.
+/// Solvers running concurrently each need their own TaintLatticeFunc, since it keeps
+/// the unions it computed.
 class TaintLatticeFunc
 {
 public:
-    TaintLatticeFunc() {}
+    explicit TaintLatticeFunc(TaintedAtSetFactory &TaintedAtSets)
+        : TaintedAtSets(TaintedAtSets)
+    {
+    }
     ~TaintLatticeFunc() {}
 
     TaintLatticeVal getUndefVal() const
@@ -197,6 +839,12 @@ public:
         return TaintLatticeVal::Untracked;
     }
 
+    /// Return the Tainted value whose instructions set holds only I.
+    TaintLatticeVal getTaintedAtVal(Instruction *I)
+    {
+        return TaintedAtSets.getSingleton(I);
+    }
+
     bool IsUntrackedValue(TaintLatticeKey Key);
 
     /// ComputeLatticeVal - Compute and return a TaintLatticeVal corresponding to the
@@ -212,7 +860,8 @@ public:
     /// instructions set and a instructions set with an Undefined value. For
     /// these cases, we simply union the instruction sets. If the size of the union
     /// is greater than the maximum instructions we track, the merged value is
-    /// overdefined.
+    /// overdefined. A Tainted value with an empty set is tainted everywhere, and
+    /// absorbs the other Tainted value.
     TaintLatticeVal MergeValues(TaintLatticeVal X, TaintLatticeVal Y);
 
     /// Compute the lattice values that change as a result of executing the given
@@ -234,6 +883,12 @@ public:
     Value *GetValueFromLatticeVal(TaintLatticeVal LV, Type *Ty = nullptr);
 
 private:
+    /// Uniques the instructions sets of the lattice values.
+    TaintedAtSetFactory &TaintedAtSets;
+
+    /// The unions computed by MergeValues.
+    TaintedAtUnionMemo Unions;
+
     /// Handle PHINode. The PHINode state is the merge of the incoming values states
     void visitPHINode(PHINode &I,
                       DenseMap<TaintLatticeKey, TaintLatticeVal> &ChangedValues,
@@ -253,7 +908,8 @@ private:
     /// Handle StoreInst. If the stored value is Tainted, we set the state of the pointer
     /// operand to Tainted and track the values that the pointer operand depends on.
     /// We also set the state of the values that the pointer operand depends on to
-    /// Tainted and handle the merge of pointer type arguments in this function.
+    /// Tainted. Writes through pointer arguments reach the callers via the function
+    /// summary in visitCallSite.
     void visitStore(StoreInst &I,
                     DenseMap<TaintLatticeKey, TaintLatticeVal> &ChangedValues,
                     TaintSolver &TS);
@@ -268,7 +924,9 @@ private:
     /// Handle CallSite. The state of a called function's formal arguments is
     /// the merge of the argument state with the call sites corresponding actual
     /// argument state. The call site state is the merge of the call site state
-    /// with the returned value state of the called function.
+    /// with the returned value state of the called function. The state of an actual
+    /// argument the called function writes through, according to its summary, is
+    /// merged with the state of the formal argument.
     void visitCallSite(CallSite CS,
                        DenseMap<TaintLatticeKey, TaintLatticeVal> &ChangedValues,
                        TaintSolver &TS);
@@ -300,6 +958,28 @@ private:
         DenseMap<TaintLatticeKey, TaintLatticeVal> &ChangedValues, TaintSolver &TS);
 };
 
+/// Return the function a lattice key is local to, or nullptr if the key is shared by
+/// the whole module, like globals and constants.
+static const Function *getKeyFunction(TaintLatticeKey Key)
+{
+    Value *V = Key.getPointer();
+    if (Key.getInt() == IPOGrouping::Return)
+        return cast<Function>(V);
+    if (auto *I = dyn_cast<Instruction>(V))
+        return I->getFunction();
+    if (auto *Arg = dyn_cast<Argument>(V))
+        return Arg->getParent();
+    return nullptr;
+}
+
+/// The state published by the solvers of all SCCs, see ParallelTaintSolver. It is
+/// only written between levels, while no solver runs.
+struct SharedTaintState
+{
+    DenseMap<TaintLatticeKey, TaintLatticeVal> ValueState;
+    SmallPtrSet<BasicBlock *, 16> BBExecutable;
+};
+
 /// TaintSolver - This class is slight modified version of llvm::SparseSolver
 class TaintSolver
 {
@@ -325,14 +1005,38 @@ class TaintSolver
     /// PHI nodes retriggered.
     std::set<Edge> KnownFeasibleEdges;
 
-    /// ValueDependencyMap - Map a value to a set of values that the value depends on.
-    const std::unordered_map<Value *, SmallPtrSet<Value *, 16>> &ValueDependencyMap;
+    /// ValueDependencies - Map a value to a set of values that the value depends on.
+    ValueDependencyGraph &ValueDependencies;
+
+    /// Reachability - Answers whether tainted definitions can reach a use.
+    ReachabilityIndex &Reachability;
+
+    /// Summaries - The effect of each function on its callers.
+    const TaintSummaries &Summaries;
+
+    /// OwnedFunctions - If set, this solver only solves these functions. The state
+    /// of the keys of other functions and of the module is read from Shared, and
+    /// changes to them are recorded in ExportedKeys.
+    const SmallPtrSetImpl<const Function *> *OwnedFunctions = nullptr;
+    const SharedTaintState *Shared = nullptr;
+
+    /// ExportedKeys - The changed keys that are published, see isExported.
+    SmallVector<TaintLatticeKey, 16> ExportedKeys;
+    DenseSet<TaintLatticeKey> ExportedKeySet;
+
+    /// ImportedKeys - The keys not owned by this solver that it started to track.
+    SmallVector<TaintLatticeKey, 16> ImportedKeys;
+
+    /// ExportedBlocks - The blocks this solver marked executable.
+    SmallVector<BasicBlock *, 16> ExportedBlocks;
+    SmallPtrSet<BasicBlock *, 16> ExportedBlockSet;
 
 public:
-    explicit TaintSolver(
-        TaintLatticeFunc *Lattice,
-        const std::unordered_map<Value *, SmallPtrSet<Value *, 16>> &ValueDependencyMap)
-        : LatticeFunc(Lattice), ValueDependencyMap(ValueDependencyMap)
+    explicit TaintSolver(TaintLatticeFunc *Lattice,
+                         ValueDependencyGraph &ValueDependencies,
+                         ReachabilityIndex &Reachability, const TaintSummaries &Summaries)
+        : LatticeFunc(Lattice), ValueDependencies(ValueDependencies),
+          Reachability(Reachability), Summaries(Summaries)
     {
     }
 
@@ -341,6 +1045,40 @@ public:
 
     void Solve();
 
+    /// setPartition - Only solve the functions in Owned, and exchange the state of
+    /// everything else through SharedState.
+    void setPartition(const SmallPtrSetImpl<const Function *> &Owned,
+                      const SharedTaintState &SharedState)
+    {
+        OwnedFunctions = &Owned;
+        Shared = &SharedState;
+    }
+
+    /// owns - Return true if the state of Key is computed by this solver.
+    bool owns(TaintLatticeKey Key) const
+    {
+        return !OwnedFunctions || OwnedFunctions->count(getKeyFunction(Key));
+    }
+
+    /// isExported - Return true if the state of Key is published to the other solvers:
+    /// the keys owned by them, and the formal arguments and return values, which the
+    /// callers read.
+    bool isExported(TaintLatticeKey Key) const
+    {
+        return OwnedFunctions && (!owns(Key) || Key.getInt() == IPOGrouping::Return ||
+                                  isa<Argument>(Key.getPointer()));
+    }
+
+    /// importState - Merge a state of Key published by another solver, and revisit
+    /// the users of Key if it changed.
+    void importState(TaintLatticeKey Key, TaintLatticeVal LV);
+
+    /// takeExports - Move out the keys and blocks changed, and the keys started to
+    /// be tracked, since the last call.
+    void takeExports(SmallVectorImpl<TaintLatticeKey> &Keys,
+                     SmallVectorImpl<BasicBlock *> &Blocks,
+                     SmallVectorImpl<TaintLatticeKey> &Imports);
+
     void Print(raw_ostream &OS) const;
 
     /// getExistingValueState - Return the TaintLatticeVal object corresponding to the
@@ -353,12 +1091,36 @@ public:
     /// is initialized.
     TaintLatticeVal getValueState(TaintLatticeKey Key);
 
-    /// hasDependency - Return true if the given value is in ValueDependencyMap.
-    bool hasDependency(Value *V);
+    /// hasDependency - Return true if the given value depends on any value.
+    bool hasDependency(Value *V) const
+    {
+        return ValueDependencies.hasDependency(V);
+    }
+
+    /// getDependency - Return the IDs of the values that the given value depends on,
+    /// directly or transitively. Use getDependencyValue to map an ID to its value.
+    const SparseBitVector<> &getDependency(Value *V)
+    {
+        return ValueDependencies.getDependency(V);
+    }
 
-    /// getDependency - Return a set of values that the given value depends on according
-    /// to ValueDependencyMap.
-    SmallPtrSet<Value *, 16> getDependency(Value *V);
+    /// getSummary - Return the summary of F, or nullptr if F has no exact definition.
+    const FunctionTaintSummary *getSummary(const Function *F) const
+    {
+        return Summaries.lookup(F);
+    }
+
+    /// getDependencyValue - Return the value numbered ID in getDependency sets.
+    Value *getDependencyValue(unsigned ID) const
+    {
+        return ValueDependencies.getValue(ID);
+    }
+
+    /// reachable - Return true if any one of DefInsts can reach UseInst.
+    bool reachable(ArrayRef<Instruction *> DefInsts, Instruction *UseInst)
+    {
+        return Reachability.reachable(DefInsts, UseInst);
+    }
 
     /// isEdgeFeasible - Return true if the control flow edge from the 'From'
     /// basic block to the 'To' basic block is currently feasible.  If
@@ -372,7 +1134,7 @@ public:
     /// querying the lattice.
     bool isBlockExecutable(BasicBlock *BB) const
     {
-        return BBExecutable.count(BB);
+        return BBExecutable.count(BB) || (Shared && Shared->BBExecutable.count(BB));
     }
 
     /// MarkBlockExecutable - This method can be used by clients to mark all of
@@ -404,6 +1166,10 @@ private:
     void visitInst(Instruction &I);
     void visitPHINode(PHINode &I);
 
+    /// visitWrittenBackCallSites - If the function of Arg writes through it and Arg is
+    /// tainted, taint the actual arguments at the executable call sites.
+    void visitWrittenBackCallSites(Argument &Arg);
+
     Value *getValueFromLatticeKey(TaintLatticeKey Key)
     {
         return Key.getPointer();
@@ -440,13 +1206,17 @@ TaintLatticeVal TaintLatticeFunc::MergeValues(TaintLatticeVal X, TaintLatticeVal
         return getOverdefinedVal();
     if (X == getUndefVal() && Y == getUndefVal())
         return getUndefVal();
-    std::vector<Instruction *> Union;
-    std::set_union(X.getTaintedAtInsts().begin(), X.getTaintedAtInsts().end(),
-                   Y.getTaintedAtInsts().begin(), Y.getTaintedAtInsts().end(),
-                   std::back_inserter(Union), TaintLatticeVal::Compare{});
-    if (Union.size() > MaxInstructionsPerValue)
+    // A value tainted at no instruction, like an argument tainted on entry, is tainted
+    // everywhere. Adding instructions would narrow where it can reach.
+    if ((X.isTainted() && !X.getTaintedAtSet()) ||
+        (Y.isTainted() && !Y.getTaintedAtSet()))
+        return TaintLatticeVal(nullptr);
+    const TaintedAtSet *LHS = X.getTaintedAtSet(), *RHS = Y.getTaintedAtSet();
+    const TaintedAtSet *Union =
+        TaintedAtSets.getUnion(LHS, RHS, MaxInstructionsPerValue, Unions);
+    if (!Union && (LHS || RHS))
         return getOverdefinedVal();
-    return TaintLatticeVal(std::move(Union));
+    return TaintLatticeVal(Union);
 }
 
 void TaintLatticeFunc::ComputeInstructionState(
@@ -537,10 +1307,10 @@ void TaintLatticeFunc::visitPHINode(
     {
         auto RegOp = TaintLatticeKey(I.getIncomingValue(i), IPOGrouping::Register);
         if (TS.getValueState(RegOp).isTainted() &&
-            reachable(TS.getValueState(RegOp).getTaintedAtInsts(), &I))
+            TS.reachable(TS.getValueState(RegOp).getTaintedAtInsts(), &I))
         {
             ChangedValues[RegPhi] =
-                MergeValues(TS.getValueState(RegPhi), TaintLatticeVal({ &I }));
+                MergeValues(TS.getValueState(RegPhi), getTaintedAtVal(&I));
             break;
         }
     }
@@ -553,10 +1323,10 @@ void TaintLatticeFunc::visitGetElementPtr(
     auto RegI = TaintLatticeKey(&I, IPOGrouping::Register);
     auto RegP = TaintLatticeKey(I.getPointerOperand(), IPOGrouping::Register);
     if (TS.getValueState(RegP).isTainted() &&
-        reachable(TS.getValueState(RegP).getTaintedAtInsts(), &I))
+        TS.reachable(TS.getValueState(RegP).getTaintedAtInsts(), &I))
     {
         ChangedValues[RegI] =
-            MergeValues(TS.getValueState(RegI), TaintLatticeVal({ &I }));
+            MergeValues(TS.getValueState(RegI), getTaintedAtVal(&I));
     }
 }
 
@@ -567,10 +1337,10 @@ void TaintLatticeFunc::visitLoad(
     auto RegI = TaintLatticeKey(&I, IPOGrouping::Register);
     auto RegP = TaintLatticeKey(I.getPointerOperand(), IPOGrouping::Register);
     if (TS.getValueState(RegP).isTainted() &&
-        reachable(TS.getValueState(RegP).getTaintedAtInsts(), &I))
+        TS.reachable(TS.getValueState(RegP).getTaintedAtInsts(), &I))
     {
         ChangedValues[RegI] =
-            MergeValues(TS.getValueState(RegI), TaintLatticeVal({ &I }));
+            MergeValues(TS.getValueState(RegI), getTaintedAtVal(&I));
     }
 }
 
@@ -581,61 +1351,16 @@ void TaintLatticeFunc::visitStore(
     auto RegV = TaintLatticeKey(I.getValueOperand(), IPOGrouping::Register);
     auto RegP = TaintLatticeKey(I.getPointerOperand(), IPOGrouping::Register);
     if (TS.getValueState(RegV).isTainted() &&
-        reachable(TS.getValueState(RegV).getTaintedAtInsts(), &I))
+        TS.reachable(TS.getValueState(RegV).getTaintedAtInsts(), &I))
     {
         // Update the state of the pointer operand
         ChangedValues[RegP] =
-            MergeValues(TS.getValueState(RegP), TaintLatticeVal({ &I }));
+            MergeValues(TS.getValueState(RegP), getTaintedAtVal(&I));
 
         // Update the state of the set of values that the pointer operand depends on
-        updateDependencyValueState(I.getPointerOperand(), TaintLatticeVal({ &I }),
+        updateDependencyValueState(I.getPointerOperand(), getTaintedAtVal(&I),
                                    ChangedValues, TS);
     }
-
-    // If the type of some function arguments is pointer, inform the solver that the
-    // caller function is executable, and perform merges for these pointer arguments.
-    // NOTE: This part of code *must* be placed in `visitStore`
-    // FIXME: Is there any way to avoid perform merges for function pointer arguments when
-    // the pointer operand of StoreInst and the set of values that the pointer operand
-    // depends are unrelated to function pointer arguments?
-    SmallVector<Argument *, 4> AffectedFnPointerArguments;
-    if (auto *Arg = dyn_cast<Argument>(I.getPointerOperand()))
-    {
-        AffectedFnPointerArguments.push_back(Arg);
-    }
-    if (TS.hasDependency(I.getPointerOperand()))
-    {
-        SmallPtrSet<Value *, 16> Values = TS.getDependency(I.getPointerOperand());
-        for (Value *V : Values)
-        {
-            if (!V->getType()->isPointerTy())
-                continue;
-            if (auto *Arg = dyn_cast<Argument>(V))
-            {
-                AffectedFnPointerArguments.push_back(Arg);
-            }
-        }
-    }
-    Function *F = I.getFunction();
-    for (Argument *Arg : AffectedFnPointerArguments)
-    {
-        for (User *U : F->users())
-        {
-            if (auto CS = CallSite(U))
-            {
-                TS.MarkBlockExecutable(CS.getInstruction()->getParent());
-                auto ArgActual = TaintLatticeKey(CS.getArgument(Arg->getArgNo()),
-                                                 IPOGrouping::Register);
-                auto ArgFormal = TaintLatticeKey(Arg, IPOGrouping::Register);
-                if (TS.getValueState(ArgFormal).isTainted())
-                {
-                    ChangedValues[ArgActual] =
-                        MergeValues(TS.getValueState(ArgActual),
-                                    TaintLatticeVal({ CS.getInstruction() }));
-                }
-            }
-        }
-    }
 }
 
 void TaintLatticeFunc::visitMemTransfer(
@@ -645,13 +1370,13 @@ void TaintLatticeFunc::visitMemTransfer(
     auto RegSrc = TaintLatticeKey(I.getOperand(1), IPOGrouping::Register);
     auto RegDst = TaintLatticeKey(I.getOperand(0), IPOGrouping::Register);
     if (TS.getValueState(RegSrc).isTainted() &&
-        reachable(TS.getValueState(RegSrc).getTaintedAtInsts(), &I))
+        TS.reachable(TS.getValueState(RegSrc).getTaintedAtInsts(), &I))
     {
         ChangedValues[RegDst] =
-            MergeValues(TS.getValueState(RegDst), TaintLatticeVal({ &I }));
+            MergeValues(TS.getValueState(RegDst), getTaintedAtVal(&I));
 
         // Update the state of the set of values that the pointer operand depends on
-        updateDependencyValueState(I.getOperand(0), TaintLatticeVal({ &I }),
+        updateDependencyValueState(I.getOperand(0), getTaintedAtVal(&I),
                                    ChangedValues, TS);
     }
 }
@@ -675,16 +1400,16 @@ void TaintLatticeFunc::visitCallSite(
                 {                                                                        \
                     auto Reg = TaintLatticeKey(I, IPOGrouping::Register);                \
                     ChangedValues[Reg] =                                                 \
-                        MergeValues(TS.getValueState(Reg), TaintLatticeVal({ I }));      \
-                    updateDependencyValueState(I, TaintLatticeVal({ I }), ChangedValues, \
+                        MergeValues(TS.getValueState(Reg), getTaintedAtVal(I));          \
+                    updateDependencyValueState(I, getTaintedAtVal(I), ChangedValues,     \
                                                TS);                                      \
                 }                                                                        \
                 else                                                                     \
                 {                                                                        \
                     auto Reg = TaintLatticeKey(I->getOperand(i), IPOGrouping::Register); \
                     ChangedValues[Reg] =                                                 \
-                        MergeValues(TS.getValueState(Reg), TaintLatticeVal({ I }));      \
-                    updateDependencyValueState(I->getOperand(i), TaintLatticeVal({ I }), \
+                        MergeValues(TS.getValueState(Reg), getTaintedAtVal(I));          \
+                    updateDependencyValueState(I->getOperand(i), getTaintedAtVal(I),     \
                                                ChangedValues, TS);                       \
                 }                                                                        \
             }                                                                            \
@@ -704,7 +1429,7 @@ void TaintLatticeFunc::visitCallSite(
             {                                                                            \
                 auto Reg = TaintLatticeKey(I->getOperand(i), IPOGrouping::Register);     \
                 if (TS.getValueState(Reg).isTainted() &&                                 \
-                    reachable(TS.getValueState(Reg).getTaintedAtInsts(), I))             \
+                    TS.reachable(TS.getValueState(Reg).getTaintedAtInsts(), I))          \
                 {                                                                        \
                     SrcTainted = true;                                                   \
                     break;                                                               \
@@ -717,9 +1442,9 @@ void TaintLatticeFunc::visitCallSite(
                     auto Reg = TaintLatticeKey(I->getOperand(i), IPOGrouping::Register); \
                     {                                                                    \
                         ChangedValues[Reg] =                                             \
-                            MergeValues(TS.getValueState(Reg), TaintLatticeVal({ I }));  \
+                            MergeValues(TS.getValueState(Reg), getTaintedAtVal(I));      \
                         updateDependencyValueState(I->getOperand(i),                     \
-                                                   TaintLatticeVal({ I }),               \
+                                                   getTaintedAtVal(I),                   \
                                                    ChangedValues, TS);                   \
                     }                                                                    \
                 }                                                                        \
@@ -745,11 +1470,30 @@ void TaintLatticeFunc::visitCallSite(
         auto ArgActual =
             TaintLatticeKey(CS.getArgument(Arg.getArgNo()), IPOGrouping::Register);
         if (TS.getValueState(ArgActual).isTainted() &&
-            reachable(TS.getValueState(ArgActual).getTaintedAtInsts(), I))
+            TS.reachable(TS.getValueState(ArgActual).getTaintedAtInsts(), I))
+        {
+            // NOTE: function arguments are tainted with an empty `TaintedAtInsts`.
+            // Merge rather than reset, so that a formal argument never changes back.
+            ChangedValues[ArgFormal] = MergeValues(TS.getValueState(ArgFormal),
+                                                   TaintLatticeVal(nullptr));
+        }
+    }
+
+    // Write the pointer arguments the called function writes through back to the
+    // actual arguments.
+    if (const FunctionTaintSummary *Summary = TS.getSummary(F))
+    {
+        for (unsigned ArgNo : Summary->WrittenArgs.set_bits())
         {
-            // NOTE: call setTainted() to mark function arguments as tainted, and
-            // `TaintedAtInsts` is empty
-            ChangedValues[ArgFormal].setTainted();
+            auto ArgFormal =
+                TaintLatticeKey(F->arg_begin() + ArgNo, IPOGrouping::Register);
+            auto ArgActual =
+                TaintLatticeKey(CS.getArgument(ArgNo), IPOGrouping::Register);
+            if (TS.getValueState(ArgFormal).isTainted())
+            {
+                ChangedValues[ArgActual] =
+                    MergeValues(TS.getValueState(ArgActual), getTaintedAtVal(I));
+            }
         }
     }
 
@@ -761,7 +1505,7 @@ void TaintLatticeFunc::visitCallSite(
     auto RegI = TaintLatticeKey(I, IPOGrouping::Register);
     if (TS.getValueState(RetF).isTainted())
     {
-        ChangedValues[RegI] = MergeValues(TS.getValueState(RegI), TaintLatticeVal({ I }));
+        ChangedValues[RegI] = MergeValues(TS.getValueState(RegI), getTaintedAtVal(I));
     }
 }
 
@@ -775,9 +1519,10 @@ void TaintLatticeFunc::visitReturn(
     auto RegI = TaintLatticeKey(I.getReturnValue(), IPOGrouping::Register);
     auto RetF = TaintLatticeKey(F, IPOGrouping::Return);
     if (TS.getValueState(RegI).isTainted() &&
-        reachable(TS.getValueState(RegI).getTaintedAtInsts(), &I))
+        TS.reachable(TS.getValueState(RegI).getTaintedAtInsts(), &I))
     {
-        ChangedValues[RetF].setTainted();
+        ChangedValues[RetF] =
+            MergeValues(TS.getValueState(RetF), TaintLatticeVal(nullptr));
     }
 }
 
@@ -789,12 +1534,12 @@ void TaintLatticeFunc::visitSelect(
     auto RegT = TaintLatticeKey(I.getTrueValue(), IPOGrouping::Register);
     auto RegF = TaintLatticeKey(I.getFalseValue(), IPOGrouping::Register);
     if ((TS.getValueState(RegT).isTainted() &&
-         reachable(TS.getValueState(RegT).getTaintedAtInsts(), &I)) ||
+         TS.reachable(TS.getValueState(RegT).getTaintedAtInsts(), &I)) ||
         (TS.getValueState(RegF).isTainted() &&
-         reachable(TS.getValueState(RegF).getTaintedAtInsts(), &I)))
+         TS.reachable(TS.getValueState(RegF).getTaintedAtInsts(), &I)))
     {
         ChangedValues[RegI] =
-            MergeValues(TS.getValueState(RegI), TaintLatticeVal({ &I }));
+            MergeValues(TS.getValueState(RegI), getTaintedAtVal(&I));
     }
 }
 
@@ -805,9 +1550,9 @@ void TaintLatticeFunc::visitCast(
     TaintLatticeKey Src = TaintLatticeKey(I.getOperand(0), IPOGrouping::Register);
     TaintLatticeKey Dst = TaintLatticeKey(&I, IPOGrouping::Register);
     if (TS.getValueState(Src).isTainted() &&
-        reachable(TS.getValueState(Src).getTaintedAtInsts(), &I))
+        TS.reachable(TS.getValueState(Src).getTaintedAtInsts(), &I))
     {
-        ChangedValues[Dst] = MergeValues(TS.getValueState(Dst), TaintLatticeVal({ &I }));
+        ChangedValues[Dst] = MergeValues(TS.getValueState(Dst), getTaintedAtVal(&I));
     }
 }
 
@@ -824,7 +1569,7 @@ void TaintLatticeFunc::visitInst(
         if (TS.getValueState(RegV).isTainted())
         {
             ChangedValues[RegI] =
-                MergeValues(ChangedValues[RegI], TaintLatticeVal({ &I }));
+                MergeValues(ChangedValues[RegI], getTaintedAtVal(&I));
             return;
         }
     }
@@ -836,9 +1581,9 @@ void TaintLatticeFunc::updateDependencyValueState(
 {
     if (TS.hasDependency(V))
     {
-        SmallPtrSet<Value *, 16> Values = TS.getDependency(V);
-        for (Value *EachValue : Values)
+        for (unsigned ID : TS.getDependency(V))
         {
+            Value *EachValue = TS.getDependencyValue(ID);
             auto Reg = TaintLatticeKey(EachValue, IPOGrouping::Register);
             ChangedValues[Reg] = MergeValues(TS.getValueState(Reg), TLV);
         }
@@ -860,6 +1605,15 @@ TaintLatticeVal TaintSolver::getValueState(TaintLatticeKey Key)
     if (I != ValueState.end())
         return I->second;  // Common case, in the map
 
+    // Start from the published state of keys owned by other solvers.
+    if (!owns(Key))
+    {
+        ImportedKeys.push_back(Key);
+        auto SI = Shared->ValueState.find(Key);
+        if (SI != Shared->ValueState.end())
+            return ValueState[Key] = SI->second;
+    }
+
     if (LatticeFunc->IsUntrackedValue(Key))
         return LatticeFunc->getUntrackedVal();
     TaintLatticeVal LV = LatticeFunc->ComputeLatticeVal(Key);
@@ -881,42 +1635,51 @@ void TaintSolver::UpdateState(TaintLatticeKey Key, TaintLatticeVal LV)
     ValueState[Key] = std::move(LV);
     if (Value *V = getValueFromLatticeKey(Key))
         ValueWorkList.push_back(V);
+
+    if (isExported(Key) && ExportedKeySet.insert(Key).second)
+        ExportedKeys.push_back(Key);
 }
 
-bool TaintSolver::hasDependency(Value *V)
+void TaintSolver::importState(TaintLatticeKey Key, TaintLatticeVal LV)
 {
-    return ValueDependencyMap.count(V);
+    TaintLatticeVal Merged = LatticeFunc->MergeValues(getValueState(Key), LV);
+    auto I = ValueState.find(Key);
+    if (I != ValueState.end() && I->second == Merged)
+        return;
+    ValueState[Key] = Merged;
+    if (Value *V = getValueFromLatticeKey(Key))
+        ValueWorkList.push_back(V);
 }
 
-SmallPtrSet<Value *, 16> TaintSolver::getDependency(Value *V)
+void TaintSolver::takeExports(SmallVectorImpl<TaintLatticeKey> &Keys,
+                              SmallVectorImpl<BasicBlock *> &Blocks,
+                              SmallVectorImpl<TaintLatticeKey> &Imports)
 {
-    SmallPtrSet<Value *, 16> Values(ValueDependencyMap.at(V));
-    bool changed = true;
-    while (changed)
-    {
-        changed = false;
-        size_t ValuesSize = Values.size();
-        SmallPtrSet<Value *, 16> Tmp;
-        for (auto *Each_V : Values)
-        {
-            if (ValueDependencyMap.count(Each_V))
-            {
-                Tmp.insert(ValueDependencyMap.at(Each_V).begin(),
-                           ValueDependencyMap.at(Each_V).end());
-            }
-        }
-        Values.insert(Tmp.begin(), Tmp.end());
-        if (ValuesSize != Values.size())
-            changed = true;
-    }
-    return Values;
+    Keys.append(ExportedKeys.begin(), ExportedKeys.end());
+    Blocks.append(ExportedBlocks.begin(), ExportedBlocks.end());
+    Imports.append(ImportedKeys.begin(), ImportedKeys.end());
+    ImportedKeys.clear();
+    ExportedKeys.clear();
+    ExportedKeySet.clear();
+    ExportedBlocks.clear();
+    ExportedBlockSet.clear();
 }
 
 void TaintSolver::MarkBlockExecutable(BasicBlock *BB)
 {
+    // A block of another solver is handed over to it.
+    if (OwnedFunctions && !OwnedFunctions->count(BB->getParent()))
+    {
+        if (!Shared->BBExecutable.count(BB) && ExportedBlockSet.insert(BB).second)
+            ExportedBlocks.push_back(BB);
+        return;
+    }
+
     if (!BBExecutable.insert(BB).second)
         return;
     BBWorkList.push_back(BB);  // Add the block to the work list!
+    if (OwnedFunctions)
+        ExportedBlocks.push_back(BB);
 }
 
 void TaintSolver::markEdgeExecutable(BasicBlock *Source, BasicBlock *Dest)
@@ -1152,6 +1915,29 @@ void TaintSolver::visitInst(Instruction &I)
 #endif
 }
 
+void TaintSolver::visitWrittenBackCallSites(Argument &Arg)
+{
+    Function *F = Arg.getParent();
+    const FunctionTaintSummary *Summary = getSummary(F);
+    if (!Summary || !Summary->WrittenArgs.test(Arg.getArgNo()) ||
+        !getValueState(getLatticeKeyFromValue(&Arg)).isTainted())
+        return;
+
+    // Only merge into the actual arguments. The call sites may belong to the
+    // solver of another SCC.
+    for (User *U : F->users())
+    {
+        CallSite CS(U);
+        if (!CS || CS.getCalledFunction() != F ||
+            !isBlockExecutable(CS.getInstruction()->getParent()))
+            continue;
+        auto ArgActual = getLatticeKeyFromValue(CS.getArgument(Arg.getArgNo()));
+        UpdateState(ArgActual, LatticeFunc->MergeValues(
+                                   getValueState(ArgActual),
+                                   LatticeFunc->getTaintedAtVal(CS.getInstruction())));
+    }
+}
+
 void TaintSolver::Solve()
 {
     // Process the work lists until they are empty!
@@ -1169,6 +1955,10 @@ void TaintSolver::Solve()
                 if (auto *Inst = dyn_cast<Instruction>(U))
                     if (BBExecutable.count(Inst->getParent()))  // Inst is executable?
                         visitInst(*Inst);
+
+            // A formal argument that is written through is also seen by the callers.
+            if (auto *Arg = dyn_cast<Argument>(V))
+                visitWrittenBackCallSites(*Arg);
         }
 
         // Process the basic block work list.
@@ -1207,53 +1997,285 @@ void TaintSolver::Print(raw_ostream &OS) const
     }
 }
 
-static bool runTP(Module &M)
+/// ParallelTaintSolver - Solve the call graph SCCs with one TaintSolver each. The SCCs
+/// are grouped into levels bottom-up, where every SCC only calls SCCs of lower levels.
+/// The SCCs of one level with pending work are solved concurrently against the shared
+/// state, which is only updated between levels. Their exports are merged in SCC order,
+/// so the result doesn't depend on the number of threads. The partitions share the
+/// TaintedAtSets but keep their own union memo, and run on a pool created once.
+class ParallelTaintSolver
 {
-    std::unordered_map<Value *, SmallPtrSet<Value *, 16>> ValueDependencyMap;
+    struct Partition
+    {
+        SmallPtrSet<const Function *, 4> Functions;
+        std::unique_ptr<TaintLatticeFunc> Lattice;
+        std::unique_ptr<TaintSolver> Solver;
 
-    for (Function &F : M)
+        /// The keys whose shared state changed and the blocks that became executable
+        /// since this partition was last solved.
+        SmallVector<TaintLatticeKey, 16> InKeys;
+        DenseSet<TaintLatticeKey> InKeySet;
+        SmallVector<BasicBlock *, 16> InBlocks;
+
+        bool hasWork() const
+        {
+            return !InKeys.empty() || !InBlocks.empty();
+        }
+    };
+
+    /// LatticeFunc - Merges the exports in publish().
+    TaintLatticeFunc LatticeFunc;
+    SharedTaintState Shared;
+    std::vector<std::unique_ptr<Partition>> Partitions;
+    DenseMap<const Function *, unsigned> FunctionPartition;
+
+    /// Levels - The partitions of each level, callees first.
+    std::vector<std::vector<unsigned>> Levels;
+
+    /// Readers - The partitions that track the state of a key they don't own.
+    DenseMap<TaintLatticeKey, SmallVector<unsigned, 2>> Readers;
+
+    unsigned NumThreads;
+    ThreadPool Pool;
+
+public:
+    ParallelTaintSolver(Module &M, TaintedAtSetFactory &TaintedAtSets,
+                        ValueDependencyGraph &ValueDependencies,
+                        ReachabilityIndex &Reachability, const TaintSummaries &Summaries,
+                        unsigned NumThreads);
+
+    ParallelTaintSolver(const ParallelTaintSolver &) = delete;
+    ParallelTaintSolver &operator=(const ParallelTaintSolver &) = delete;
+
+    /// MarkBlockExecutable - Queue BB for the partition of its function.
+    void MarkBlockExecutable(BasicBlock *BB)
     {
-        for (inst_iterator i = inst_begin(F), e = inst_end(F); i != e; ++i)
+        auto It = FunctionPartition.find(BB->getParent());
+        if (It != FunctionPartition.end() && Shared.BBExecutable.insert(BB).second)
+            Partitions[It->second]->InBlocks.push_back(BB);
+    }
+
+    void Solve();
+
+    /// getExistingValueState - Return the state of Key computed by its owner, or the
+    /// shared state if the key isn't owned by any partition.
+    TaintLatticeVal getExistingValueState(TaintLatticeKey Key) const;
+
+private:
+    /// getOwner - Return the partition owning Key, or -1 if it is shared.
+    int getOwner(TaintLatticeKey Key) const
+    {
+        auto It = FunctionPartition.find(getKeyFunction(Key));
+        return It != FunctionPartition.end() ? (int)It->second : -1;
+    }
+
+    void notify(int Idx, TaintLatticeKey Key)
+    {
+        if (Idx < 0)
+            return;
+        Partition &P = *Partitions[Idx];
+        if (P.InKeySet.insert(Key).second)
+            P.InKeys.push_back(Key);
+    }
+
+    /// solvePartition - Feed the pending work of a partition to its solver and solve.
+    void solvePartition(Partition &P);
+
+    /// publish - Merge the exports of the solved partitions into the shared state and
+    /// queue the changes for the partitions that depend on them.
+    void publish(ArrayRef<unsigned> Solved);
+};
+
+ParallelTaintSolver::ParallelTaintSolver(Module &M, TaintedAtSetFactory &TaintedAtSets,
+                                         ValueDependencyGraph &ValueDependencies,
+                                         ReachabilityIndex &Reachability,
+                                         const TaintSummaries &Summaries,
+                                         unsigned NumThreads)
+    : LatticeFunc(TaintedAtSets), NumThreads(NumThreads),
+#if LLVM_VERSION_MAJOR >= 10
+      Pool(hardware_concurrency(NumThreads))
+#else
+      Pool(NumThreads)
+#endif
+{
+    auto addPartition = [&](unsigned Level) {
+        Partitions.emplace_back(new Partition());
+        Partition &P = *Partitions.back();
+        P.Lattice.reset(new TaintLatticeFunc(TaintedAtSets));
+        P.Solver.reset(
+            new TaintSolver(P.Lattice.get(), ValueDependencies, Reachability, Summaries));
+        P.Solver->setPartition(P.Functions, Shared);
+        if (Levels.size() <= Level)
+            Levels.resize(Level + 1);
+        Levels[Level].push_back(Partitions.size() - 1);
+    };
+
+    // Every function with a body belongs to the partition of its SCC, one level above
+    // the SCCs it calls.
+    std::vector<unsigned> PartitionLevel;
+    CallGraph CG(M);
+    for (scc_iterator<CallGraph *> I = scc_begin(&CG); !I.isAtEnd(); ++I)
+    {
+        SmallVector<const Function *, 4> SCC;
+        for (CallGraphNode *Node : *I)
         {
-            Instruction *I = &*i;
-            if (auto *GEPI = dyn_cast<GetElementPtrInst>(I))
-            {
-                ValueDependencyMap[GEPI].insert(GEPI->getPointerOperand());
-            }
-            else if (auto *PN = dyn_cast<PHINode>(I))
+            const Function *F = Node->getFunction();
+            if (F && !F->isDeclaration())
+                SCC.push_back(F);
+        }
+        if (SCC.empty())
+            continue;
+
+        unsigned Level = 0;
+        for (CallGraphNode *Node : *I)
+            for (auto &Callee : *Node)
             {
-                for (Value *V : PN->incoming_values())
-                {
-                    ValueDependencyMap[PN].insert(V);
-                }
+                auto It = FunctionPartition.find(Callee.second->getFunction());
+                if (It != FunctionPartition.end())
+                    Level = std::max(Level, PartitionLevel[It->second] + 1);
             }
-            else if (auto *SI = dyn_cast<SelectInst>(I))
+        PartitionLevel.push_back(Level);
+        addPartition(Level);
+        for (const Function *F : SCC)
+        {
+            Partitions.back()->Functions.insert(F);
+            FunctionPartition[F] = Partitions.size() - 1;
+        }
+    }
+
+    // Functions unreachable in the call graph are solved together, after the others.
+    unsigned Rest = Partitions.size();
+    for (Function &F : M)
+    {
+        if (F.isDeclaration() || FunctionPartition.count(&F))
+            continue;
+        if (Partitions.size() == Rest)
+            addPartition(Levels.size());
+        Partitions.back()->Functions.insert(&F);
+        FunctionPartition[&F] = Rest;
+    }
+}
+
+void ParallelTaintSolver::solvePartition(Partition &P)
+{
+    for (BasicBlock *BB : P.InBlocks)
+        P.Solver->MarkBlockExecutable(BB);
+    for (TaintLatticeKey Key : P.InKeys)
+        P.Solver->importState(Key, Shared.ValueState.lookup(Key));
+    P.InBlocks.clear();
+    P.InKeys.clear();
+    P.InKeySet.clear();
+    P.Solver->Solve();
+}
+
+void ParallelTaintSolver::publish(ArrayRef<unsigned> Solved)
+{
+    SmallVector<TaintLatticeKey, 64> Changed;
+    DenseSet<TaintLatticeKey> ChangedSet;
+    for (unsigned Idx : Solved)
+    {
+        SmallVector<TaintLatticeKey, 16> Keys, Imports;
+        SmallVector<BasicBlock *, 16> Blocks;
+        TaintSolver &Solver = *Partitions[Idx]->Solver;
+        Solver.takeExports(Keys, Blocks, Imports);
+
+        // The own blocks are only published, the others are handed over.
+        for (BasicBlock *BB : Blocks)
+            if (Partitions[Idx]->Functions.count(BB->getParent()))
+                Shared.BBExecutable.insert(BB);
+            else
+                MarkBlockExecutable(BB);
+
+        Imports.append(Keys.begin(), Keys.end());
+        for (TaintLatticeKey Key : Imports)
+        {
+            SmallVectorImpl<unsigned> &KeyReaders = Readers[Key];
+            if (std::find(KeyReaders.begin(), KeyReaders.end(), Idx) == KeyReaders.end())
+                KeyReaders.push_back(Idx);
+        }
+
+        for (TaintLatticeKey Key : Keys)
+        {
+            TaintLatticeVal LV = Solver.getExistingValueState(Key);
+            auto It = Shared.ValueState.find(Key);
+            if (It != Shared.ValueState.end())
+                LV = LatticeFunc.MergeValues(It->second, LV);
+            if (It != Shared.ValueState.end() && It->second == LV)
+                continue;
+            Shared.ValueState[Key] = LV;
+            if (ChangedSet.insert(Key).second)
+                Changed.push_back(Key);
+        }
+    }
+
+    // The owner of a changed key, the partitions using it and the partitions tracking
+    // it have to revisit it.
+    for (TaintLatticeKey Key : Changed)
+    {
+        notify(getOwner(Key), Key);
+        for (User *U : Key.getPointer()->users())
+            if (auto *I = dyn_cast<Instruction>(U))
             {
-                ValueDependencyMap[SI].insert(
-                    { SI->getTrueValue(), SI->getFalseValue() });
+                auto It = FunctionPartition.find(I->getFunction());
+                if (It != FunctionPartition.end())
+                    notify(It->second, Key);
             }
-            else if (auto *CI = dyn_cast<CastInst>(I))
+        for (unsigned Idx : Readers.lookup(Key))
+            notify(Idx, Key);
+    }
+}
+
+void ParallelTaintSolver::Solve()
+{
+    bool HasWork = true;
+    while (HasWork)
+    {
+        HasWork = false;
+        for (const std::vector<unsigned> &Level : Levels)
+        {
+            SmallVector<unsigned, 16> Ready;
+            for (unsigned Idx : Level)
+                if (Partitions[Idx]->hasWork())
+                    Ready.push_back(Idx);
+            if (Ready.empty())
+                continue;
+            HasWork = true;
+
+            unsigned Workers = std::min<size_t>(NumThreads, Ready.size());
+            if (Workers <= 1)
             {
-                ValueDependencyMap[CI].insert(CI->getOperand(0));
+                for (unsigned Idx : Ready)
+                    solvePartition(*Partitions[Idx]);
             }
-            else if (auto *LI = dyn_cast<LoadInst>(I))
+            else
             {
-                if (LI->getType()->isPointerTy())
+                for (unsigned Idx : Ready)
                 {
-                    ValueDependencyMap[LI].insert(LI->getPointerOperand());
+                    Partition *P = Partitions[Idx].get();
+                    Pool.async([this, P]() { solvePartition(*P); });
                 }
+                Pool.wait();
             }
-            else
-            {
-                // TODO: handle other instructions
-            }
+
+            publish(Ready);
         }
     }
+}
 
-    // Our custom lattice function and solver.
-    TaintLatticeFunc Lattice;
-    TaintSolver Solver(&Lattice, ValueDependencyMap);
+TaintLatticeVal ParallelTaintSolver::getExistingValueState(TaintLatticeKey Key) const
+{
+    int Owner = getOwner(Key);
+    if (Owner >= 0)
+        return Partitions[Owner]->Solver->getExistingValueState(Key);
+    auto It = Shared.ValueState.find(Key);
+    return It != Shared.ValueState.end() ? It->second : LatticeFunc.getUntrackedVal();
+}
 
+/// Seed Solver with the taint sources of M, solve, and attach the !taint metadata.
+/// SolverT is a TaintSolver over the whole module or a ParallelTaintSolver.
+template <typename SolverT>
+static void solveTP(Module &M, SolverT &Solver, ReachabilityIndex &Reachability)
+{
     for (Function &F : M)
     {
 #define HANDLE_TAINT_SOURCE(FUNC_NAME, ARGS)                                             \
@@ -1297,7 +2319,7 @@ static bool runTP(Module &M)
             {
                 auto TLK = TaintLatticeKey(V, IPOGrouping::Register);
                 TaintLatticeVal TLV = Solver.getExistingValueState(TLK);
-                if (TLV.isTainted() && reachable(TLV.getTaintedAtInsts(), I))
+                if (TLV.isTainted() && Reachability.reachable(TLV.getTaintedAtInsts(), I))
                 {
                     TaintsMetadatas.push_back(ValueAsMetadata::get(V));
                 }
@@ -1310,6 +2332,74 @@ static bool runTP(Module &M)
             }
         }
     }
+}
+
+static bool runTP(Module &M)
+{
+    ValueDependencyGraph ValueDependencies;
+
+    for (Function &F : M)
+    {
+        for (inst_iterator i = inst_begin(F), e = inst_end(F); i != e; ++i)
+        {
+            Instruction *I = &*i;
+            if (auto *GEPI = dyn_cast<GetElementPtrInst>(I))
+            {
+                ValueDependencies.addDependency(GEPI, GEPI->getPointerOperand());
+            }
+            else if (auto *PN = dyn_cast<PHINode>(I))
+            {
+                for (Value *V : PN->incoming_values())
+                {
+                    ValueDependencies.addDependency(PN, V);
+                }
+            }
+            else if (auto *SI = dyn_cast<SelectInst>(I))
+            {
+                ValueDependencies.addDependency(SI, SI->getTrueValue());
+                ValueDependencies.addDependency(SI, SI->getFalseValue());
+            }
+            else if (auto *CI = dyn_cast<CastInst>(I))
+            {
+                ValueDependencies.addDependency(CI, CI->getOperand(0));
+            }
+            else if (auto *LI = dyn_cast<LoadInst>(I))
+            {
+                if (LI->getType()->isPointerTy())
+                {
+                    ValueDependencies.addDependency(LI, LI->getPointerOperand());
+                }
+            }
+            else
+            {
+                // TODO: handle other instructions
+            }
+        }
+    }
+
+    ValueDependencies.finalize();
+
+    // Summarize the functions bottom-up.
+    TaintSummaries Summaries;
+    Summaries.compute(M, ValueDependencies);
+
+    // Our custom lattice function and solver. A single thread solves the whole module
+    // with one solver; more threads solve the call-graph SCCs concurrently.
+    TaintedAtSetFactory TaintedAtSets(M);
+    ReachabilityIndex Reachability;
+    unsigned Threads = TaintThreads ? TaintThreads : std::thread::hardware_concurrency();
+    if (Threads <= 1)
+    {
+        TaintLatticeFunc Lattice(TaintedAtSets);
+        TaintSolver Solver(&Lattice, ValueDependencies, Reachability, Summaries);
+        solveTP(M, Solver, Reachability);
+        return false;
+    }
+
+    Reachability.prepare(M);
+    ParallelTaintSolver Solver(M, TaintedAtSets, ValueDependencies, Reachability,
+                               Summaries, Threads);
+    solveTP(M, Solver, Reachability);
     return false;
 }
 
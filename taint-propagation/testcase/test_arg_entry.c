@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+// `buf` is tainted on entry to copy(), so it is tainted at every instruction of
+// copy(), also before the store through it. The expected output of copy() is:
+//
+//   %arrayidx = getelementptr inbounds i8, i8* %buf, i64 0, !taint !{i8* %buf}
+//   %0 = load i8, i8* %arrayidx, align 1, !taint !{i8* %arrayidx}
+//   %arrayidx1 = getelementptr inbounds i8, i8* %buf, i64 1, !taint !{i8* %buf}
+//   store i8 %0, i8* %arrayidx1, align 1, !taint !{i8 %0, i8* %arrayidx1}
+//   %arrayidx2 = getelementptr inbounds i8, i8* %buf, i64 2, !taint !{i8* %buf}
+//
+// If the store narrowed `buf` to the instructions after it, the first two
+// getelementptrs would lose their !taint.
+void copy(char *buf, int n)
+{
+    char c = buf[0];
+    if (n)
+        buf[1] = c;
+    putchar(buf[2]);
+}
+
+int main(int argc, char **argv)
+{
+    char buf[16];
+    FILE *inf = fopen(argv[1], "r");
+    fread(buf, sizeof(buf), 1, inf);
+    copy(buf, argc);
+    return 0;
+}